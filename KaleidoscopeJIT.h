@@ -15,62 +15,245 @@
 
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/iterator_range.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Object/SymbolSize.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "SlabMemoryManager.h"
 #include <algorithm>
+#include <cstdio>
+#include <functional>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
 namespace llvm::orc {
 
+    /// Writes /tmp/perf-<pid>.map entries for every function in a loaded object,
+    /// which is what perf uses to symbolize addresses it cannot find in an ELF image.
+    class PerfMapEventListener : public JITEventListener {
+        FILE* MapFile;
+
+    public:
+        PerfMapEventListener() {
+            std::string Path = "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+            MapFile = fopen(Path.c_str(), "w");
+        }
+
+        ~PerfMapEventListener() override {
+            if (MapFile)
+                fclose(MapFile);
+        }
+
+        void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                                const RuntimeDyld::LoadedObjectInfo &L) override {
+            if (!MapFile)
+                return;
+            // The debug object has its sections relocated to their load addresses.
+            object::OwningBinary<object::ObjectFile> DebugObjOwner = L.getObjectForDebug(Obj);
+            if (!DebugObjOwner.getBinary())
+                return;
+            for (const auto &[Sym, Size] : object::computeSymbolSizes(*DebugObjOwner.getBinary())) {
+                auto Type = Sym.getType();
+                if (!Type) {
+                    consumeError(Type.takeError());
+                    continue;
+                }
+                if (*Type != object::SymbolRef::ST_Function)
+                    continue;
+                auto Name = Sym.getName();
+                auto Addr = Sym.getAddress();
+                if (!Name || !Addr) {
+                    consumeError(Name.takeError());
+                    consumeError(Addr.takeError());
+                    continue;
+                }
+                fprintf(MapFile, "%llx %llx %s\n", (unsigned long long) *Addr, (unsigned long long) Size,
+                        Name->str().c_str());
+            }
+            fflush(MapFile);
+        }
+    };
+
     class KaleidoscopeJIT {
     public:
         using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
-        using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
-
-        KaleidoscopeJIT()
-                : Resolver(createLegacyLookupResolver(
-                ES,
-                [this](StringRef Name) {
-                    return findMangledSymbol(std::string(Name));
-                },
-                [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-                  TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+
+        explicit KaleidoscopeJIT(SlabAllocator::Options SlabOpts = {})
+                : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()), Slabs(SlabOpts),
                   ObjectLayer(AcknowledgeORCv1Deprecation, ES,
-                              [this](VModuleKey) {
-                                  return ObjLayerT::Resources{
-                                          std::make_shared<SectionMemoryManager>(), Resolver};
+                              [this](VModuleKey K) {
+                                  auto MemMgr = std::make_shared<SlabMemoryManager>(Slabs);
+                                  MemoryManagers[K] = MemMgr;
+                                  // Each module gets its own resolver so we can record which
+                                  // modules it bound to when it is linked.
+                                  auto Resolver = createLegacyLookupResolver(
+                                          ES,
+                                          [this, K](StringRef Name) {
+                                              return findMangledSymbol(std::string(Name), K);
+                                          },
+                                          [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); });
+                                  return ObjLayerT::Resources{MemMgr, Resolver};
+                              },
+                              [this](VModuleKey K, const object::ObjectFile &Obj,
+                                     const RuntimeDyld::LoadedObjectInfo &Info) {
+                                  for (auto* L : EventListeners)
+                                      L->notifyObjectLoaded(K, Obj, Info);
+                              },
+                              ObjLayerT::NotifyFinalizedFtor(),
+                              [this](VModuleKey K, const object::ObjectFile &) {
+                                  for (auto* L : EventListeners)
+                                      L->notifyFreeingObject(K);
                               }),
-                  CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                               SimpleCompiler(*TM)) {
+                  Compiler(*TM), Stubs(createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())()) {
             llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
         }
 
         TargetMachine &getTargetMachine() { return *TM; }
 
-        VModuleKey addModule(std::unique_ptr<Module> M) {
+        /// Listeners are notified for every object linked or freed after registration.
+        void registerEventListener(JITEventListener &L) {
+            EventListeners.push_back(&L);
+        }
+
+        /// Compile M and add the object. A retained module holds definitions: it
+        /// keeps its bitcode and object around so they can be written to a session
+        /// snapshot, and its functions are called through stubs (see addObject).
+        VModuleKey addModule(std::unique_ptr<Module> M, bool Retain = false) {
+            std::vector<std::string> Defines;
+            for (auto &GV : M->global_values())
+                if (!GV.isDeclaration() && GV.hasExternalLinkage())
+                    Defines.push_back(mangle(GV.getName().str()));
+            std::string Bitcode;
+            if (Retain) {
+                raw_string_ostream OS(Bitcode);
+                WriteBitcodeToFile(*M, OS);
+            }
+            auto Obj = cantFail(Compiler(*M));
+            return addObject(std::move(Obj), std::move(Defines), Retain ? Optional<StringRef>(Bitcode) : None);
+        }
+
+        /// Add an already compiled object defining the given mangled symbols.
+        ///
+        /// Functions defined by a retained object are linked right away and every
+        /// other module reaches them through an indirect stub, so a redefinition
+        /// only repoints the stub: callers compiled earlier pick up the new body
+        /// without being recompiled, and the old module can be released.
+        VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj, std::vector<std::string> Defines,
+                             Optional<StringRef> RetainBitcode = None) {
             auto K = ES.allocateVModule();
-            cantFail(CompileLayer.addModule(K, std::move(M)));
+            auto &Info = Modules[K];
+            Info.Defines = std::move(Defines);
+            if (RetainBitcode) {
+                Info.Bitcode = RetainBitcode->str();
+                Info.Object = MemoryBuffer::getMemBufferCopy(Obj->getBuffer(), Obj->getBufferIdentifier());
+            }
+            cantFail(ObjectLayer.addObject(K, std::move(Obj)));
             ModuleKeys.push_back(K);
+            if (RetainBitcode)
+                for (auto &Name : Modules[K].Defines)
+                    bindStub(K, Name);
+            releaseDeadModules();
             return K;
         }
 
+        /// Visit the bitcode and object of every retained module, oldest first.
+        void forEachRetainedModule(
+                function_ref<void(ArrayRef<std::string> Defines, StringRef Bitcode, MemoryBufferRef Object)> F) const {
+            for (auto K : ModuleKeys) {
+                auto &Info = Modules.at(K);
+                if (Info.Object)
+                    F(Info.Defines, Info.Bitcode, Info.Object->getMemBufferRef());
+            }
+        }
+
+        /// The triple, CPU and features objects are compiled for; snapshots only link objects on a match.
+        std::string getTargetCPU() const {
+            return (Twine(TM->getTargetTriple().str()) + "/" + TM->getTargetCPU() + "/" +
+                    TM->getTargetFeatureString()).str();
+        }
+
+        /// Modules already released as dead are skipped.
         void removeModule(VModuleKey K) {
-            ModuleKeys.erase(find(ModuleKeys, K));
-            cantFail(CompileLayer.removeModule(K));
+            if (!Modules.count(K))
+                return;
+            releaseModule(K);
+            releaseDeadModules();
+        }
+
+        /// Release every module defining Name and free the stubs of all they
+        /// define, for a definition that is gone for good: nothing may call it,
+        /// or anything defined along with it, any more.
+        void removeDefinition(const std::string &Name) {
+            auto Mangled = mangle(Name);
+            std::vector<VModuleKey> Defining;
+            for (auto K : ModuleKeys)
+                if (is_contained(Modules.at(K).Defines, Mangled))
+                    Defining.push_back(K);
+            for (auto K : Defining) {
+                for (auto &Define : Modules.at(K).Defines)
+                    freeStub(Define);
+                releaseModule(K);
+            }
+            releaseDeadModules();
+        }
+
+        /// Section bytes linked for module K; zero until the module is materialized.
+        SlabMemoryManager::Usage getModuleMemoryUsage(VModuleKey K) const {
+            auto It = MemoryManagers.find(K);
+            return It != MemoryManagers.end() ? It->second->getUsage() : SlabMemoryManager::Usage();
+        }
+
+        SlabAllocator::Stats getSlabStats() const { return Slabs.getStats(); }
+
+        /// Changes whenever jitted code may depend on state a process forked
+        /// earlier does not have: a new or repointed stub, a new host symbol or
+        /// a new slab. Code linked into existing shared slabs does not count.
+        uint64_t getGeneration() const { return Generation + Slabs.getStats().SlabsMapped; }
+
+        /// Called in a process forked to run jitted code, see SlabAllocator::makeTextExecutable.
+        void makeTextExecutable() { Slabs.makeTextExecutable(); }
+
+        void printMemoryStats(raw_ostream &OS) const {
+            auto S = getSlabStats();
+            OS << "slabs: text " << S.Slabs[SlabAllocator::Text] << " (" << S.LiveBytes[SlabAllocator::Text]
+               << "/" << S.MappedBytes[SlabAllocator::Text] << " bytes live), data " << S.Slabs[SlabAllocator::Data]
+               << " (" << S.LiveBytes[SlabAllocator::Data] << "/" << S.MappedBytes[SlabAllocator::Data]
+               << " bytes live)\n";
+            OS << "modules: " << ModuleKeys.size() << " resident, " << ReleasedModules << " released\n";
+            for (auto K : ModuleKeys) {
+                auto U = getModuleMemoryUsage(K);
+                OS << "  module " << K << " (";
+                interleave(Modules.at(K).Defines, OS, ", ");
+                OS << "): code " << U.CodeBytes << ", rodata " << U.RODataBytes << ", data " << U.RWDataBytes
+                   << "\n";
+            }
+        }
+
+        /// Resolve Name in jitted code to an address in this process, ahead of
+        /// the process's own symbol table. With Release, the symbol belongs to
+        /// the modules linked against it: it is removed and Release called once
+        /// the last of them is released.
+        void addHostSymbol(StringRef Name, void* Addr, std::function<void()> Release = nullptr) {
+            auto Mangled = mangle(Name.str());
+            HostSymbols[Mangled] = pointerToJITTargetAddress(Addr);
+            if (Release)
+                HostReleasers[Mangled] = std::move(Release);
+            ++Generation;
         }
 
         JITSymbol findSymbol(const std::string Name) {
@@ -87,7 +270,110 @@ namespace llvm::orc {
             return MangledName;
         }
 
-        JITSymbol findMangledSymbol(const std::string &Name) {
+        /// Per-module bookkeeping used to decide when a module can be released.
+        struct ModuleInfo {
+            /// Mangled names of the external definitions in the module.
+            std::vector<std::string> Defines;
+            /// Modules whose definitions this module was linked against.
+            std::set<VModuleKey> BoundTo;
+            /// Host symbols with a release callback this module was linked against.
+            std::set<std::string> HostUses;
+            /// Only set for retained modules.
+            std::string Bitcode;
+            std::unique_ptr<MemoryBuffer> Object;
+        };
+
+        /// Point the stub for Name at its definition in module K, creating the stub
+        /// on first definition. The pointer is a single aligned word, so threads
+        /// calling through the stub see either the old body or the new one.
+        void bindStub(VModuleKey K, const std::string &Name) {
+            auto Sym = ObjectLayer.findSymbolIn(K, Name, false);
+            if (!Sym || !Sym.getFlags().isCallable())
+                return;
+            auto Addr = cantFail(Sym.getAddress());
+            auto Stub = StubNames.find(Name);
+            if (Stub != StubNames.end()) {
+                cantFail(Stubs->updatePointer(Stub->second, Addr));
+            } else if (!FreeStubs.empty()) {
+                cantFail(Stubs->updatePointer(FreeStubs.back(), Addr));
+                StubNames[Name] = FreeStubs.back();
+                FreeStubs.pop_back();
+            } else {
+                cantFail(Stubs->createStub(Name, Addr, JITSymbolFlags::Exported | JITSymbolFlags::Callable));
+                StubNames[Name] = Name;
+            }
+            ++Generation;
+        }
+
+        /// Stop resolving Name to its stub and keep the stub for another name; the
+        /// stubs manager cannot delete one. The stub is pointed at null so a call
+        /// left over faults instead of running freed code.
+        void freeStub(const std::string &Name) {
+            auto Stub = StubNames.find(Name);
+            if (Stub == StubNames.end())
+                return;
+            cantFail(Stubs->updatePointer(Stub->second, 0));
+            FreeStubs.push_back(Stub->second);
+            StubNames.erase(Stub);
+            ++Generation;
+        }
+
+        void releaseModule(VModuleKey K) {
+            auto HostUses = std::move(Modules.at(K).HostUses);
+            ModuleKeys.erase(find(ModuleKeys, K));
+            cantFail(ObjectLayer.removeObject(K));
+            MemoryManagers.erase(K);
+            Modules.erase(K);
+            ++ReleasedModules;
+            for (auto &Name : HostUses)
+                if (none_of(Modules, [&](const auto &Entry) { return Entry.second.HostUses.count(Name); }))
+                    releaseHostSymbol(Name);
+        }
+
+        void releaseHostSymbol(const std::string &Name) {
+            auto Release = std::move(HostReleasers.at(Name));
+            HostReleasers.erase(Name);
+            HostSymbols.erase(Name);
+            Release();
+        }
+
+        /// A module is dead once every symbol it defines is shadowed by a newer
+        /// module (e.g. a redefined function) and no live module was linked
+        /// against it. Releasing one module can make others dead, so iterate.
+        void releaseDeadModules() {
+            bool Changed = true;
+            while (Changed) {
+                Changed = false;
+                for (size_t I = 0; I < ModuleKeys.size(); ++I) {
+                    auto K = ModuleKeys[I];
+                    if (isShadowed(I) && !isBound(K)) {
+                        releaseModule(K);
+                        Changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        bool isShadowed(size_t Idx) const {
+            auto &Defines = Modules.at(ModuleKeys[Idx]).Defines;
+            if (Defines.empty())
+                return false;
+            return all_of(Defines, [&](const std::string &Name) {
+                for (size_t J = Idx + 1; J < ModuleKeys.size(); ++J)
+                    if (is_contained(Modules.at(ModuleKeys[J]).Defines, Name))
+                        return true;
+                return false;
+            });
+        }
+
+        bool isBound(VModuleKey K) const {
+            return any_of(Modules, [K](const auto &Entry) {
+                return Entry.first != K && Entry.second.BoundTo.count(K);
+            });
+        }
+
+        JITSymbol findMangledSymbol(const std::string &Name, Optional<VModuleKey> Requester = None) {
 #ifdef _WIN32
             // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
             // flag to decide whether a symbol will be visible or not, when we call
@@ -101,12 +387,27 @@ namespace llvm::orc {
             const bool ExportedSymbolsOnly = true;
 #endif
 
+            // Definitions are always reached through their stub, so callers never
+            // bind to a particular module.
+            if (auto Stub = StubNames.find(Name); Stub != StubNames.end())
+                if (auto Sym = Stubs->findStub(Stub->second, ExportedSymbolsOnly))
+                    return Sym;
+            auto Host = HostSymbols.find(Name);
+            if (Host != HostSymbols.end()) {
+                if (Requester && HostReleasers.count(Name))
+                    Modules[*Requester].HostUses.insert(Name);
+                return JITSymbol(Host->second, JITSymbolFlags::Exported);
+            }
+
             // Search modules in reverse order: from last added to first added.
             // This is the opposite of the usual search order for dlsym, but makes more
             // sense in a REPL where we want to bind to the newest available definition.
             for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-                if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+                if (auto Sym = ObjectLayer.findSymbolIn(H, Name, ExportedSymbolsOnly)) {
+                    if (Requester && *Requester != H)
+                        Modules[*Requester].BoundTo.insert(H);
                     return Sym;
+                }
 
             // If we can't find the symbol in the JIT, try looking in the host process.
             if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
@@ -126,12 +427,24 @@ namespace llvm::orc {
         }
 
         ExecutionSession ES;
-        std::shared_ptr<SymbolResolver> Resolver;
         std::unique_ptr<TargetMachine> TM;
         const DataLayout DL;
+        SlabAllocator Slabs;
+        std::map<VModuleKey, std::shared_ptr<SlabMemoryManager>> MemoryManagers;
         ObjLayerT ObjectLayer;
-        CompileLayerT CompileLayer;
+        SimpleCompiler Compiler;
+        std::unique_ptr<IndirectStubsManager> Stubs;
+        /// The stub each definition is called through, by mangled name; a stub
+        /// freed by one name is reused for the next new one.
+        std::map<std::string, std::string> StubNames;
+        std::vector<std::string> FreeStubs;
+        std::map<std::string, JITTargetAddress> HostSymbols;
+        std::map<std::string, std::function<void()>> HostReleasers;
         std::vector<VModuleKey> ModuleKeys;
+        std::map<VModuleKey, ModuleInfo> Modules;
+        size_t ReleasedModules = 0;
+        uint64_t Generation = 0;
+        std::vector<JITEventListener*> EventListeners;
     };
 
 } // end namespace llvm
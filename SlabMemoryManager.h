@@ -0,0 +1,339 @@
+//===- SlabMemoryManager.h - Shared slab allocator for jitted sections ----===//
+//
+// Packs the sections of many small modules into a few large mappings instead
+// of giving every module its own SectionMemoryManager.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_SLABMEMORYMANAGER_H
+#define KALEIDOSCOPE_SLABMEMORYMANAGER_H
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/Alignment.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace llvm::orc {
+
+    /// SlabAllocator - hands out blocks from large mappings shared by all modules.
+    ///
+    /// Text blocks (code and read-only data) are page granular because their
+    /// protection is flipped to read/execute once a module is finalized, but
+    /// consecutive modules still share one mapping. Writable data is packed at
+    /// byte granularity. A slab is unmapped once its last block is released.
+    class SlabAllocator {
+    public:
+        enum Kind { Text, Data };
+
+        struct Options {
+            size_t SlabSize = 4 << 20;
+            /// Ask for transparent huge pages on text slabs. The kernel can only back
+            /// a 2M range with a huge page once its protections are uniform, i.e.
+            /// when the slab has been filled with finalized code.
+            bool HugePages = false;
+            /// Map slabs shared rather than private, so processes forked later
+            /// see sections linked after the fork (see makeTextExecutable).
+            bool Shared = false;
+        };
+
+        struct Stats {
+            size_t Slabs[2] = {0, 0};
+            size_t MappedBytes[2] = {0, 0};
+            size_t LiveBytes[2] = {0, 0};
+            /// Slabs mapped so far, including ones released since.
+            size_t SlabsMapped = 0;
+        };
+
+        explicit SlabAllocator(Options Opts) : Opts(Opts) {
+            if (Opts.HugePages)
+                this->Opts.SlabSize = alignTo(Opts.SlabSize, HugePageSize);
+        }
+
+        SlabAllocator(const SlabAllocator &) = delete;
+        SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+        ~SlabAllocator() {
+            for (auto &Slabs : SlabsByKind)
+                for (auto &S : Slabs)
+                    sys::Memory::releaseMappedMemory(S.Mem);
+        }
+
+        sys::MemoryBlock allocate(Kind K, size_t Size, size_t Alignment) {
+            std::lock_guard<std::mutex> Lock(M);
+            if (K == Text) {
+                Size = alignTo(Size, PageSize);
+                Alignment = std::max(Alignment, PageSize);
+            }
+            auto &Slabs = SlabsByKind[K];
+            for (auto &S : Slabs)
+                if (auto *P = S.allocate(Size, Alignment))
+                    return sys::MemoryBlock(P, Size);
+            Slabs.push_back(mapSlab(K, std::max(Opts.SlabSize, alignTo(Size + Alignment, PageSize))));
+            auto *P = Slabs.back().allocate(Size, Alignment);
+            assert(P && "fresh slab too small");
+            return sys::MemoryBlock(P, Size);
+        }
+
+        void release(Kind K, sys::MemoryBlock Block) {
+            std::lock_guard<std::mutex> Lock(M);
+            auto &Slabs = SlabsByKind[K];
+            auto *P = static_cast<char *>(Block.base());
+            auto It = llvm::find_if(Slabs, [P](const Slab &S) { return S.contains(P); });
+            assert(It != Slabs.end() && "block not owned by this allocator");
+            if (K == Text)
+                sys::Memory::protectMappedMemory(Block, sys::Memory::MF_READ | sys::Memory::MF_WRITE);
+            It->release(P, Block.allocatedSize());
+            // Keep one slab of each kind mapped so a REPL evaluating one expression
+            // at a time does not map and unmap a slab per statement.
+            if (It->Live == 0 && Slabs.size() > 1) {
+                sys::Memory::releaseMappedMemory(It->Mem);
+                Slabs.erase(It);
+            }
+        }
+
+        /// In a process forked to run jitted code: make all text slabs
+        /// executable. With shared slabs, code the parent links into them
+        /// later shows up here already executable.
+        void makeTextExecutable() {
+            std::lock_guard<std::mutex> Lock(M);
+            for (auto &S : SlabsByKind[Text])
+                sys::Memory::protectMappedMemory(S.Mem, sys::Memory::MF_READ | sys::Memory::MF_EXEC);
+        }
+
+        Stats getStats() const {
+            std::lock_guard<std::mutex> Lock(M);
+            Stats Result;
+            Result.SlabsMapped = SlabsMapped;
+            for (int K = Text; K <= Data; ++K)
+                for (auto &S : SlabsByKind[K]) {
+                    Result.Slabs[K]++;
+                    Result.MappedBytes[K] += S.Mem.allocatedSize();
+                    Result.LiveBytes[K] += S.Live;
+                }
+            return Result;
+        }
+
+    private:
+        static constexpr size_t HugePageSize = 2 << 20;
+
+        struct Slab {
+            sys::MemoryBlock Mem;
+            /// Free ranges keyed by offset from the slab base.
+            std::map<size_t, size_t> Free;
+            size_t Live = 0;
+
+            explicit Slab(sys::MemoryBlock Mem) : Mem(Mem) {
+                Free[0] = Mem.allocatedSize();
+            }
+
+            char *base() const { return static_cast<char *>(Mem.base()); }
+
+            bool contains(const char *P) const {
+                return P >= base() && P < base() + Mem.allocatedSize();
+            }
+
+            char *allocate(size_t Size, size_t Alignment) {
+                for (auto It = Free.begin(); It != Free.end(); ++It) {
+                    auto [Off, Len] = *It;
+                    size_t Start = alignAddr(base() + Off, Align(Alignment)) - (uintptr_t) base();
+                    if (Start + Size > Off + Len)
+                        continue;
+                    Free.erase(It);
+                    if (Start > Off)
+                        Free[Off] = Start - Off;
+                    if (Start + Size < Off + Len)
+                        Free[Start + Size] = Off + Len - Start - Size;
+                    Live += Size;
+                    return base() + Start;
+                }
+                return nullptr;
+            }
+
+            void release(char *P, size_t Size) {
+                size_t Off = P - base();
+                Live -= Size;
+                auto Next = Free.lower_bound(Off);
+                if (Next != Free.end() && Off + Size == Next->first) {
+                    Size += Next->second;
+                    Next = Free.erase(Next);
+                }
+                if (Next != Free.begin()) {
+                    auto Prev = std::prev(Next);
+                    if (Prev->first + Prev->second == Off) {
+                        Prev->second += Size;
+                        return;
+                    }
+                }
+                Free[Off] = Size;
+            }
+        };
+
+        Slab mapSlab(Kind K, size_t Size) {
+            // Keep slabs close together so 32-bit PC-relative relocations between
+            // text and data stay in range.
+            const sys::MemoryBlock *Near = nullptr;
+            for (auto &Slabs : SlabsByKind)
+                if (!Slabs.empty())
+                    Near = &Slabs.back().Mem;
+            bool Huge = K == Text && Opts.HugePages;
+            std::error_code EC;
+            auto Mem = Opts.Shared ? mapShared(Huge ? Size + HugePageSize : Size, Near, EC)
+                                   : sys::Memory::allocateMappedMemory(Huge ? Size + HugePageSize : Size, Near,
+                                                                       sys::Memory::MF_READ | sys::Memory::MF_WRITE,
+                                                                       EC);
+            if (EC)
+                report_fatal_error(Twine("cannot map JIT slab: ") + EC.message());
+#ifdef __linux__
+            if (Huge) {
+                // Trim the mapping to a 2M aligned window so it can be backed by huge pages.
+                auto *Base = static_cast<char *>(Mem.base());
+                auto *Aligned = reinterpret_cast<char *>(alignAddr(Base, Align(HugePageSize)));
+                auto *End = Base + Mem.allocatedSize();
+                if (Aligned > Base) {
+                    sys::MemoryBlock Head(Base, Aligned - Base);
+                    sys::Memory::releaseMappedMemory(Head);
+                }
+                if (Aligned + Size < End) {
+                    sys::MemoryBlock Tail(Aligned + Size, End - (Aligned + Size));
+                    sys::Memory::releaseMappedMemory(Tail);
+                }
+                Mem = sys::MemoryBlock(Aligned, Size);
+                madvise(Aligned, Size, MADV_HUGEPAGE);
+            }
+#endif
+            ++SlabsMapped;
+            return Slab(Mem);
+        }
+
+        sys::MemoryBlock mapShared(size_t Size, const sys::MemoryBlock *Near, std::error_code &EC) {
+#ifdef __linux__
+            Size = alignTo(Size, PageSize);
+            auto *Hint = Near ? static_cast<char *>(Near->base()) + Near->allocatedSize() : nullptr;
+            void *P = mmap(Hint, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (P == MAP_FAILED) {
+                EC = std::error_code(errno, std::generic_category());
+                return sys::MemoryBlock();
+            }
+            return sys::MemoryBlock(P, Size);
+#else
+            EC = std::make_error_code(std::errc::not_supported);
+            return sys::MemoryBlock();
+#endif
+        }
+
+        Options Opts;
+        size_t PageSize = sys::Process::getPageSizeEstimate();
+        mutable std::mutex M;
+        std::vector<Slab> SlabsByKind[2];
+        size_t SlabsMapped = 0;
+    };
+
+    /// SlabMemoryManager - the per-module memory manager handed to the object
+    /// linking layer. RuntimeDyld tells it the total section sizes up front, so
+    /// each module takes exactly one text block and one data block from the
+    /// shared SlabAllocator and returns them when the module is removed.
+    class SlabMemoryManager : public RTDyldMemoryManager {
+    public:
+        struct Usage {
+            size_t CodeBytes = 0;
+            size_t RODataBytes = 0;
+            size_t RWDataBytes = 0;
+        };
+
+        explicit SlabMemoryManager(SlabAllocator &Allocator) : Allocator(Allocator) {}
+
+        ~SlabMemoryManager() override {
+            for (auto &[K, Block] : Blocks)
+                Allocator.release(K, Block);
+        }
+
+        bool needsToReserveAllocationSpace() override { return true; }
+
+        void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign, uintptr_t RODataSize,
+                                    uint32_t RODataAlign, uintptr_t RWDataSize, uint32_t RWDataAlign) override {
+            size_t TextSize = alignTo(CodeSize, std::max<uint32_t>(RODataAlign, 1)) + RODataSize;
+            if (TextSize)
+                TextArena = reserve(SlabAllocator::Text, TextSize, std::max(CodeAlign, RODataAlign));
+            if (RWDataSize)
+                DataArena = reserve(SlabAllocator::Data, RWDataSize, RWDataAlign);
+        }
+
+        uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+                                     StringRef SectionName) override {
+            Use.CodeBytes += Size;
+            return allocateFrom(TextArena, SlabAllocator::Text, Size, Alignment);
+        }
+
+        uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+                                     StringRef SectionName, bool IsReadOnly) override {
+            if (IsReadOnly) {
+                Use.RODataBytes += Size;
+                return allocateFrom(TextArena, SlabAllocator::Text, Size, Alignment);
+            }
+            Use.RWDataBytes += Size;
+            return allocateFrom(DataArena, SlabAllocator::Data, Size, Alignment);
+        }
+
+        bool finalizeMemory(std::string *ErrMsg) override {
+            for (auto &[K, Block] : Blocks) {
+                if (K != SlabAllocator::Text)
+                    continue;
+                if (auto EC = sys::Memory::protectMappedMemory(Block, sys::Memory::MF_READ | sys::Memory::MF_EXEC)) {
+                    if (ErrMsg)
+                        *ErrMsg = EC.message();
+                    return true;
+                }
+                sys::Memory::InvalidateInstructionCache(Block.base(), Block.allocatedSize());
+            }
+            return false;
+        }
+
+        const Usage &getUsage() const { return Use; }
+
+    private:
+        struct Arena {
+            char *Next = nullptr;
+            char *End = nullptr;
+        };
+
+        Arena reserve(SlabAllocator::Kind K, size_t Size, size_t Alignment) {
+            auto Block = Allocator.allocate(K, Size, std::max<size_t>(Alignment, 16));
+            Blocks.emplace_back(K, Block);
+            auto *Base = static_cast<char *>(Block.base());
+            return {Base, Base + Block.allocatedSize()};
+        }
+
+        uint8_t *allocateFrom(Arena &A, SlabAllocator::Kind K, uintptr_t Size, unsigned Alignment) {
+            if (!Alignment)
+                Alignment = 16;
+            auto *P = reinterpret_cast<char *>(alignAddr(A.Next, Align(Alignment)));
+            if (!A.Next || P + Size > A.End) {
+                // RuntimeDyld underestimated (or never reserved); take a block of our own.
+                A = reserve(K, Size, Alignment);
+                P = A.Next;
+            }
+            A.Next = P + Size;
+            return reinterpret_cast<uint8_t *>(P);
+        }
+
+        SlabAllocator &Allocator;
+        std::vector<std::pair<SlabAllocator::Kind, sys::MemoryBlock>> Blocks;
+        Arena TextArena, DataArena;
+        Usage Use;
+    };
+
+} // end namespace llvm::orc
+
+#endif // KALEIDOSCOPE_SLABMEMORYMANAGER_H
@@ -0,0 +1,150 @@
+#include <llvm/ADT/bit.h>
+#include "ast.hpp"
+
+using namespace llvm;
+using namespace AST;
+
+namespace {
+    /// Distinguishes node kinds in profiles, so e.g. a variable and a call of the same name differ.
+    enum ProfileTag {
+        NumberTag = 1,
+        VariableTag,
+        UnaryTag,
+        BinaryTag,
+        VarTag,
+        CallTag,
+        IfTag,
+        ForTag,
+        NoExprTag,
+    };
+
+    void profileOptional(FoldingSetNodeID &id, const std::unique_ptr<ExprAST> &expr) {
+        if (expr)
+            expr->profile(id);
+        else
+            id.AddInteger(NoExprTag);
+    }
+
+    bool isBuiltinBinop(char op) {
+        return op == '=' || op == '+' || op == '-' || op == '*' || op == '<';
+    }
+}
+
+void NumberExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(NumberTag);
+    id.AddInteger(bit_cast<uint64_t>(val));
+}
+
+void VariableExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(VariableTag);
+    id.AddString(name);
+}
+
+void UnaryExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(UnaryTag);
+    id.AddInteger(opCode);
+    operand->profile(id);
+}
+
+void BinaryExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(BinaryTag);
+    id.AddInteger(op);
+    lhs->profile(id);
+    rhs->profile(id);
+}
+
+void VarExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(VarTag);
+    id.AddInteger(varNames.size());
+    for (const auto &[varName, init]: varNames) {
+        id.AddString(varName);
+        profileOptional(id, init);
+    }
+    body->profile(id);
+}
+
+void CallExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(CallTag);
+    id.AddString(callee);
+    id.AddInteger(args.size());
+    for (const auto &arg: args)
+        arg->profile(id);
+}
+
+void IfExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(IfTag);
+    cond->profile(id);
+    then->profile(id);
+    else_->profile(id);
+}
+
+void ForExprAST::profile(FoldingSetNodeID &id) const {
+    id.AddInteger(ForTag);
+    id.AddInteger(static_cast<int>(reduction));
+    id.AddString(varName);
+    start->profile(id);
+    end->profile(id);
+    profileOptional(id, step);
+    body->profile(id);
+}
+
+void NumberExprAST::forEachChild(function_ref<void(const ExprAST &)>) const {}
+
+void VariableExprAST::forEachChild(function_ref<void(const ExprAST &)>) const {}
+
+void UnaryExprAST::forEachChild(function_ref<void(const ExprAST &)> fn) const {
+    fn(*operand);
+}
+
+void BinaryExprAST::forEachChild(function_ref<void(const ExprAST &)> fn) const {
+    fn(*lhs);
+    fn(*rhs);
+}
+
+void VarExprAST::forEachChild(function_ref<void(const ExprAST &)> fn) const {
+    for (const auto &[varName, init]: varNames)
+        if (init)
+            fn(*init);
+    fn(*body);
+}
+
+void CallExprAST::forEachChild(function_ref<void(const ExprAST &)> fn) const {
+    for (const auto &arg: args)
+        fn(*arg);
+}
+
+void IfExprAST::forEachChild(function_ref<void(const ExprAST &)> fn) const {
+    fn(*cond);
+    fn(*then);
+    fn(*else_);
+}
+
+void ForExprAST::forEachChild(function_ref<void(const ExprAST &)> fn) const {
+    fn(*start);
+    fn(*end);
+    if (step)
+        fn(*step);
+    fn(*body);
+}
+
+static void addCallees(const ExprAST &expr, std::set<std::string> &callees) {
+    if (auto* call = dynamic_cast<const CallExprAST*>(&expr))
+        callees.insert(call->getCallee());
+    else if (auto* unary = dynamic_cast<const UnaryExprAST*>(&expr))
+        callees.insert(std::string("unary") + unary->getOpCode());
+    else if (auto* binary = dynamic_cast<const BinaryExprAST*>(&expr); binary && !isBuiltinBinop(binary->getOp()))
+        callees.insert(std::string("binary") + binary->getOp());
+    expr.forEachChild([&](const ExprAST &child) { addCallees(child, callees); });
+}
+
+std::set<std::string> AST::collectCallees(const ExprAST &expr) {
+    std::set<std::string> callees;
+    addCallees(expr, callees);
+    return callees;
+}
+
+size_t AST::countNodes(const ExprAST &expr) {
+    size_t n = 1;
+    expr.forEachChild([&](const ExprAST &child) { n += countNodes(child); });
+    return n;
+}
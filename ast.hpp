@@ -1,20 +1,38 @@
 #ifndef AST_HPP
 #define AST_HPP
 
+#include <set>
 #include <string>
 #include <utility>
 #include <memory>
+#include <optional>
 #include <vector>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/FoldingSet.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/IR/Value.h>
+#include "location.hpp"
 
 namespace AST {
     using namespace llvm;
 
     class ExprAST {
+        SourceLocation loc;
     public:
         virtual ~ExprAST() = default;
 
         virtual Value* codegen() = 0;
+
+        /// Add the structure of this expression to id; equal ids mean equal expressions.
+        virtual void profile(FoldingSetNodeID &id) const = 0;
+
+        virtual void forEachChild(function_ref<void(const ExprAST &)> fn) const = 0;
+
+        void setLoc(SourceLocation l) { loc = l; }
+
+        [[nodiscard]] int getLine() const { return loc.line; }
+
+        [[nodiscard]] int getCol() const { return loc.col; }
     };
 
     class NumberExprAST : public ExprAST {
@@ -22,7 +40,13 @@ namespace AST {
     public:
         explicit NumberExprAST(double val) : val(val) {}
 
+        [[nodiscard]] double getVal() const { return val; }
+
         Value* codegen() override;
+
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
     };
 
     class VariableExprAST : public ExprAST {
@@ -33,6 +57,10 @@ namespace AST {
 
         Value* codegen() override;
 
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
+
         [[nodiscard]] const std::string &getName() const {
             return name;
         }
@@ -45,8 +73,14 @@ namespace AST {
     public:
         UnaryExprAST(char opCode, std::unique_ptr<ExprAST> operand) : opCode(opCode), operand(std::move(operand)) {}
 
+        [[nodiscard]] char getOpCode() const { return opCode; }
+
         Value* codegen() override;
 
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
+
     };
 
     class BinaryExprAST : public ExprAST {
@@ -57,8 +91,20 @@ namespace AST {
                                                                                              lhs(std::move(lhs)),
                                                                                              rhs(std::move(rhs)) {}
 
+        [[nodiscard]] char getOp() const { return op; }
+
+        [[nodiscard]] const ExprAST &getLHS() const { return *lhs; }
+
+        [[nodiscard]] const ExprAST &getRHS() const { return *rhs; }
+
+        [[nodiscard]] ExprAST &getRHS() { return *rhs; }
+
         Value* codegen() override;
 
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
+
     };
 
     class VarExprAST : public ExprAST {
@@ -68,39 +114,109 @@ namespace AST {
         VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames,
                    std::unique_ptr<ExprAST> body) : varNames(std::move(varNames)), body(std::move(body)) {}
 
+        /// The variables in the order they are bound, each with its initializer if it has one.
+        [[nodiscard]] const std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> &getVars() const {
+            return varNames;
+        }
+
+        [[nodiscard]] const ExprAST &getBody() const { return *body; }
+
         Value* codegen() override;
+
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
     };
 
     class CallExprAST : public ExprAST {
         std::string callee;
         std::vector<std::unique_ptr<ExprAST>> args;
+
+        Value* codegenTailCall(Function* target, ArrayRef<Value*> argsV, ArrayRef<Value*> targetArgs);
+
     public:
         CallExprAST(const std::string &callee, std::vector<std::unique_ptr<ExprAST>> args) : callee(callee),
                                                                                              args(std::move(args)) {}
 
+        [[nodiscard]] const std::string &getCallee() const { return callee; }
+
         Value* codegen() override;
 
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
+
     };
 
     class IfExprAST : public ExprAST {
         std::unique_ptr<ExprAST> cond, then, else_;
+
     public:
         IfExprAST(std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> then, std::unique_ptr<ExprAST> else_)
                 : cond(std::move(cond)), then(std::move(then)), else_(std::move(else_)) {}
 
+        /// Lower to a select rather than branches; see addSpeculationCost.
+        [[nodiscard]] bool isSelect() const;
+
+        [[nodiscard]] const ExprAST &getCond() const { return *cond; }
+
+        [[nodiscard]] const ExprAST &getThen() const { return *then; }
+
+        [[nodiscard]] const ExprAST &getElse() const { return *else_; }
+
         Value* codegen() override;
+
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
     };
 
     class ForExprAST : public ExprAST {
+    public:
+        /// What the loop evaluates to: 0.0, or its body's values combined over every iteration.
+        enum class Reduction {
+            None,
+            Sum,
+            Product,
+            Min,
+            Max,
+        };
+
+    private:
         std::string varName;
         std::unique_ptr<ExprAST> start, end, step, body;
+        Reduction reduction;
+
+        Value* codegenCounted();
+
     public:
         ForExprAST(const std::string &varName, std::unique_ptr<ExprAST> start, std::unique_ptr<ExprAST> end,
-                   std::unique_ptr<ExprAST> step, std::unique_ptr<ExprAST> body)
+                   std::unique_ptr<ExprAST> step, std::unique_ptr<ExprAST> body, Reduction reduction = Reduction::None)
                 : varName(varName), start(std::move(start)), end(std::move(end)), step(std::move(step)),
-                  body(std::move(body)) {}
+                  body(std::move(body)), reduction(reduction) {}
+
+        /// The loop is "i = a, i < n, s" with integer constants a and s > 0, n loop
+        /// invariant and i not assigned in the body.
+        [[nodiscard]] bool isCounted() const;
+
+        [[nodiscard]] const std::string &getVarName() const { return varName; }
+
+        [[nodiscard]] const ExprAST &getStart() const { return *start; }
+
+        [[nodiscard]] const ExprAST &getEnd() const { return *end; }
+
+        /// nullptr for the default step of 1.
+        [[nodiscard]] const ExprAST* getStep() const { return step.get(); }
+
+        [[nodiscard]] const ExprAST &getBody() const { return *body; }
+
+        [[nodiscard]] Reduction getReduction() const { return reduction; }
 
         Value* codegen() override;
+
+        void profile(FoldingSetNodeID &id) const override;
+
+        void forEachChild(function_ref<void(const ExprAST &)> fn) const override;
     };
 
     class PrototypeAST {
@@ -108,6 +224,7 @@ namespace AST {
         std::vector<std::string> args;
         bool isOp;
         unsigned precedence;
+        int line = 0;
 
     public:
         PrototypeAST(const std::string &name, std::vector<std::string> args, bool isOp = false, unsigned precedence = 0)
@@ -129,6 +246,12 @@ namespace AST {
         }
 
         [[nodiscard]] unsigned getBinaryPrecedence() const { return precedence; }
+
+        void setLine(int l) { line = l; }
+
+        [[nodiscard]] const std::vector<std::string> &getArgs() const { return args; }
+
+        [[nodiscard]] int getLine() const { return line; }
     };
 
     class FunctionAST {
@@ -139,8 +262,39 @@ namespace AST {
         FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body) : proto(std::move(proto)),
                                                                                           body(std::move(body)) {}
 
+        /// Can be called again to recompile the function, e.g. after a callee's effects changed.
         Function* codegen();
+
+        /// An internal clone in the current module with the parameters that have a
+        /// value in constArgs bound to it; only the others remain parameters.
+        Function* codegenSpecialization(const std::vector<std::optional<double>> &constArgs);
+
+        [[nodiscard]] std::string getSpecializationName(const std::vector<std::optional<double>> &constArgs) const;
+
+        [[nodiscard]] const std::string &getName() const { return proto->getName(); }
+
+        [[nodiscard]] const PrototypeAST &getProto() const { return *proto; }
+
+        [[nodiscard]] const ExprAST &getBody() const { return *body; }
     };
+
+    /// Names of the functions an expression calls directly, including user-defined operators.
+    std::set<std::string> collectCallees(const ExprAST &expr);
+
+    /// Number of nodes in the expression tree, a proxy for the code it generates.
+    size_t countNodes(const ExprAST &expr);
+
+    /// Bits of the floating-point numbers definitions compute with and pass to
+    /// each other: 64, or 32 with --precision=single.
+    unsigned numberBits();
+
+    /// Emit "void <name>.batch(const double* in, double* out, i64 rows)" into the
+    /// current module, which stores name's result for each row of arity
+    /// consecutive arguments in `in` to out[row]. A definition's body is inlined
+    /// into the loop rather than called through its stub, so the kernel keeps
+    /// the body it was compiled with. Rows and results stay doubles in single
+    /// precision, converted around the body.
+    Function* codegenBatchKernel(const std::string &name);
 }
 
 #endif //AST_HPP
@@ -0,0 +1,343 @@
+// kaleidoscope-bench: generates scalable Kaleidoscope programs and times each
+// stage of compiling and running them separately. Prints one JSON object per
+// workload and stage:
+//
+//   {"workload":"defs","scale":1000,"stage":"lex","unit":"tokens/s","repeats":5,
+//    "mean":...,"stddev":...,"min":...,"max":...}
+//
+// The compiler options of kaleidoscope (--O0, --low-latency, --vector-math, ...)
+// apply here too, so configurations can be compared.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <llvm/Support/CommandLine.h>
+#include "binop.hpp"
+#include "parser.hpp"
+#include "registry.hpp"
+#include "KaleidoscopeJIT.h"
+
+using namespace parser;
+
+namespace {
+    enum class Workload {
+        Defs,
+        Deep,
+        Operators,
+        Recursive,
+        Loops,
+    };
+}
+
+static cl::list<Workload> workloads(
+        "workloads", cl::desc("Workloads to run (default: all)"), cl::CommaSeparated,
+        cl::values(clEnumValN(Workload::Defs, "defs", "Many small definitions calling each other"),
+                   clEnumValN(Workload::Deep, "deep", "Large, deeply nested expressions"),
+                   clEnumValN(Workload::Operators, "operators", "Heavy use of user-defined operators"),
+                   clEnumValN(Workload::Recursive, "recursive", "Recursive kernels"),
+                   clEnumValN(Workload::Loops, "loops", "Loop kernels")));
+static cl::opt<unsigned> scale("scale", cl::desc("Size of the generated programs"), cl::init(1000));
+static cl::opt<unsigned> repeats("repeat", cl::desc("Measured runs of every workload"), cl::init(5));
+static cl::opt<unsigned> warmups("warmup", cl::desc("Unmeasured runs before the measured ones"), cl::init(1));
+static cl::opt<unsigned> iterations("iterations", cl::desc("Calls of the entry expression per run"), cl::init(10));
+static cl::opt<bool> printProgram("print-program", cl::desc("Print the generated programs instead of timing them"));
+
+extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
+extern std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+extern std::map<std::string, std::unique_ptr<FunctionAST>> definitions;
+extern BinopTable binops;
+
+void initSession();
+void initModule();
+llvm::orc::VModuleKey addModuleToJIT(bool retain = false);
+
+namespace {
+    const char* workloadName(Workload w) {
+        switch (w) {
+            case Workload::Defs:
+                return "defs";
+            case Workload::Deep:
+                return "deep";
+            case Workload::Operators:
+                return "operators";
+            case Workload::Recursive:
+                return "recursive";
+            case Workload::Loops:
+                return "loops";
+        }
+        return "";
+    }
+
+    /// A balanced tree of size binary operators over x and small constants,
+    /// every level parenthesized.
+    std::string balancedExpr(unsigned size, unsigned seed) {
+        static const char ops[] = {'+', '*', '-', '<'};
+        if (size == 0)
+            return seed % 3 ? "x" : std::to_string(seed % 10);
+        unsigned left = (size - 1) / 2;
+        return "(" + balancedExpr(left, seed * 7 + 1) + " " + ops[seed % 4] + " " +
+               balancedExpr(size - 1 - left, seed * 13 + 2) + ")";
+    }
+
+    /// depth operators, each nested in the parentheses of the one before.
+    std::string nestedExpr(unsigned depth, unsigned seed) {
+        static const char ops[] = {'+', '*', '-'};
+        std::string expr = "x";
+        for (unsigned i = 0; i < depth; i++)
+            expr = "(" + std::to_string((seed + i) % 10) + " " + ops[(seed + i) % 3] + " " + expr + ")";
+        return expr;
+    }
+
+    /// Definitions followed by a single top-level expression, the entry point.
+    std::string generate(Workload w, unsigned n) {
+        n = std::max(n, 1u);
+        std::string src;
+        auto def = [&](const std::string &line) { src += "def " + line + ";\n"; };
+        switch (w) {
+            case Workload::Defs:
+                def("small0(x y) x * y + 1");
+                for (unsigned i = 1; i < n; i++)
+                    def("small" + std::to_string(i) + "(x y) small" + std::to_string(i - 1) + "(y, x + " +
+                        std::to_string(i % 7) + ") - x * 0.5");
+                src += "small" + std::to_string(n - 1) + "(1, 2);\n";
+                break;
+            case Workload::Deep: {
+                // Nesting is capped below the parser's limit on expression depth.
+                unsigned fns = 10, size = std::max(n / fns, 1u);
+                std::string entry;
+                for (unsigned k = 0; k < fns; k++) {
+                    def("deep" + std::to_string(k) + "(x) " +
+                        (k % 2 ? nestedExpr(std::min(size, 5000u), k) : balancedExpr(size, k)));
+                    entry += (k ? " + deep" : "deep") + std::to_string(k) + "(" + std::to_string(k % 3) + ")";
+                }
+                src += entry + ";\n";
+                break;
+            }
+            case Workload::Operators:
+                def("unary!(v) if v then 0 else 1");
+                def("unary-(v) 0 - v");
+                def("binary> 10 (a b) b < a");
+                def("binary| 5 (a b) if a then 1 else if b then 1 else 0");
+                def("binary& 6 (a b) if !a then 0 else !!b");
+                def("binary: 1 (x y) y");
+                for (unsigned i = 0; i < n; i++)
+                    def("ops" + std::to_string(i) + "(a b) (a > b | !(a < b) & b > " + std::to_string(i % 5) +
+                        ") : -a + b * " + std::to_string(i % 3));
+                src += "for sum i = 0, i < 1000 in ops0(i, 500) + ops" + std::to_string(n / 2) + "(i, 3) + ops" +
+                       std::to_string(n - 1) + "(500, i);\n";
+                break;
+            case Workload::Recursive: {
+                def("fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2)");
+                def("sumTo(n acc) if n < 1 then acc else sumTo(n - 1, acc + n)");
+                def("tak(x y z) if y < x then tak(tak(x - 1, y, z), tak(y - 1, z, x), tak(z - 1, x, y)) else z");
+                auto fibArg = 10 + static_cast<unsigned>(std::log2(n));
+                src += "fib(" + std::to_string(fibArg) + ") + sumTo(" + std::to_string(std::min(n, 10000u)) +
+                       ", 0) + tak(18, 12, 6);\n";
+                break;
+            }
+            case Workload::Loops: {
+                def("dot(n) for sum i = 0, i < n in i * 0.5");
+                def("nested(n) for sum i = 0, i < n in for sum j = 0, j < i in i * j");
+                def("decay(n) var acc = 0 in (for i = 0, i < n in acc = acc * 0.5 + i) + acc");
+                def("peak(n) for max i = 0, i < n in (i * 7 + 3) - (i * i) * 0.01");
+                auto len = std::to_string(n * 100);
+                src += "dot(" + len + ") + nested(" + std::to_string(static_cast<unsigned>(std::sqrt(n * 100.0))) +
+                       ") + decay(" + len + ") + peak(" + len + ");\n";
+                break;
+            }
+        }
+        return src;
+    }
+
+    struct Program {
+        std::vector<std::unique_ptr<FunctionAST>> defns;
+        std::unique_ptr<FunctionAST> entry;
+        size_t nodes = 0;
+    };
+
+    /// Parse source the way the REPL would, registering operator precedences as
+    /// their definitions are parsed since codegen, which normally does it, runs
+    /// later. False after reporting a statement that does not parse.
+    bool parseProgram(std::string &source, Program &program) {
+        FILE* in = fmemopen(source.data(), source.size(), "r");
+        resetLexer(in);
+        getNextToken();
+        bool ok = true;
+        while (ok && curTok != Token::EOF_) {
+            if (curTok == ';') {
+                getNextToken();
+            } else if (curTok == Token::DEF) {
+                auto fn = parseDefn();
+                if ((ok = fn != nullptr)) {
+                    if (fn->getProto().isBinaryOp())
+                        binops.define(fn->getProto().getOperatorName(),
+                                      static_cast<int>(fn->getProto().getBinaryPrecedence()));
+                    program.nodes += countNodes(fn->getBody());
+                    program.defns.push_back(std::move(fn));
+                }
+            } else if ((program.entry = parseTopLevelExpr())) {
+                program.nodes += countNodes(program.entry->getBody());
+            } else {
+                ok = false;
+            }
+        }
+        fclose(in);
+        if (!ok)
+            fprintf(stderr, "Error: A generated program does not parse: %s\n", lastError.c_str());
+        return ok;
+    }
+
+    using Clock = std::chrono::steady_clock;
+
+    double seconds(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    /// One value per stage of a single run.
+    struct Sample {
+        double lex, parse, codegen, jit, lookup, execute;
+    };
+
+    /// Compile and run source in a fresh session.
+    bool runOnce(std::string &source, Sample &sample) {
+        binops = {};
+        definitions.clear();
+        functionProtos.clear();
+        functionInfos.clear();
+        initSession();
+        initModule();
+
+        FILE* in = fmemopen(source.data(), source.size(), "r");
+        resetLexer(in);
+        size_t tokens = 0;
+        auto start = Clock::now();
+        while (gettok() != Token::EOF_)
+            tokens++;
+        sample.lex = tokens / seconds(start);
+        fclose(in);
+
+        Program program;
+        start = Clock::now();
+        if (!parseProgram(source, program) || !program.entry) {
+            if (!program.entry)
+                fprintf(stderr, "Error: A generated program has no entry expression\n");
+            return false;
+        }
+        sample.parse = program.nodes / seconds(start);
+
+        // Mirrors addDefinition without recompiling dependents: every function
+        // is defined once, so nothing is redefined.
+        double codegenTime = 0, jitTime = 0;
+        std::vector<std::string> names;
+        for (auto &fn: program.defns) {
+            auto name = fn->getName();
+            registerDefinition(name, fn->getBody());
+            auto &defn = definitions[name] = std::move(fn);
+            start = Clock::now();
+            if (!defn->codegen()) {
+                fprintf(stderr, "Error: Cannot compile %s\n", name.c_str());
+                return false;
+            }
+            codegenTime += seconds(start);
+            start = Clock::now();
+            addModuleToJIT(true);
+            initModule();
+            jitTime += seconds(start);
+            names.push_back(name);
+        }
+        start = Clock::now();
+        if (!program.entry->codegen()) {
+            fprintf(stderr, "Error: Cannot compile the entry expression\n");
+            return false;
+        }
+        functionProtos.erase("__anon_expr");
+        codegenTime += seconds(start);
+        start = Clock::now();
+        auto key = addModuleToJIT();
+        initModule();
+        auto fn = (double (*)()) (intptr_t) cantFail(jit->findSymbol("__anon_expr").getAddress());
+        jitTime += seconds(start);
+        auto modules = program.defns.size() + 1;
+        sample.codegen = codegenTime / modules * 1e6;
+        sample.jit = jitTime / modules * 1e6;
+
+        const unsigned rounds = 100;
+        start = Clock::now();
+        for (unsigned r = 0; r < rounds; r++)
+            for (auto &name: names)
+                if (!jit->findSymbol(name)) {
+                    fprintf(stderr, "Error: %s not found\n", name.c_str());
+                    return false;
+                }
+        sample.lookup = seconds(start) / (rounds * names.size()) * 1e9;
+
+        volatile double sink = 0;
+        start = Clock::now();
+        for (unsigned i = 0; i < iterations; i++)
+            sink = sink + fn();
+        sample.execute = seconds(start) / std::max(1u, unsigned(iterations)) * 1e9;
+        jit->removeModule(key);
+        return true;
+    }
+
+    void report(Workload w, const char* stage, const char* unit, const std::vector<double> &values) {
+        double mean = 0;
+        for (double v: values)
+            mean += v;
+        mean /= values.size();
+        double var = 0;
+        for (double v: values)
+            var += (v - mean) * (v - mean);
+        double stddev = values.size() > 1 ? std::sqrt(var / (values.size() - 1)) : 0;
+        auto [min, max] = std::minmax_element(values.begin(), values.end());
+        printf("{\"workload\":\"%s\",\"scale\":%u,\"stage\":\"%s\",\"unit\":\"%s\",\"repeats\":%zu,"
+               "\"mean\":%.6g,\"stddev\":%.6g,\"min\":%.6g,\"max\":%.6g}\n",
+               workloadName(w), unsigned(scale), stage, unit, values.size(), mean, stddev, *min, *max);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char** argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope benchmark suite\n");
+    std::vector<Workload> selected(workloads.begin(), workloads.end());
+    if (selected.empty())
+        selected = {Workload::Defs, Workload::Deep, Workload::Operators, Workload::Recursive, Workload::Loops};
+    if (printProgram) {
+        for (auto w: selected)
+            printf("# %s\n%s", workloadName(w), generate(w, scale).c_str());
+        return 0;
+    }
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+    LLVMInitializeNativeAsmParser();
+
+    for (auto w: selected) {
+        auto source = generate(w, scale);
+        std::vector<Sample> samples;
+        for (unsigned run = 0; run < warmups + repeats; run++) {
+            Sample sample{};
+            if (!runOnce(source, sample))
+                return 1;
+            if (run >= warmups)
+                samples.push_back(sample);
+        }
+        if (samples.empty())
+            continue;
+        auto stage = [&](const char* name, const char* unit, double Sample::*field) {
+            std::vector<double> values;
+            for (auto &s: samples)
+                values.push_back(s.*field);
+            report(w, name, unit, values);
+        };
+        stage("lex", "tokens/s", &Sample::lex);
+        stage("parse", "nodes/s", &Sample::parse);
+        stage("codegen", "us/function", &Sample::codegen);
+        stage("jit", "us/module", &Sample::jit);
+        stage("lookup", "ns/lookup", &Sample::lookup);
+        stage("execute", "ns/call", &Sample::execute);
+    }
+    return 0;
+}
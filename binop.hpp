@@ -0,0 +1,48 @@
+#ifndef BINOP_HPP
+#define BINOP_HPP
+
+#include <array>
+
+/// BinopTable - precedence and associativity of the binary operators, indexed
+/// by the operator's character so the parser classifies a token with a single
+/// load. Precedence 0 marks a character that is not a binary operator.
+class BinopTable {
+public:
+    struct Entry {
+        int prec = 0;
+        bool rightAssoc = false;
+    };
+
+    /// The built-in operators. '=' groups to the right, so a = b = 1 assigns both.
+    BinopTable() {
+        define('=', 2, true);
+        define('<', 10);
+        define('+', 20);
+        define('-', 30);
+        define('*', 40);
+    }
+
+    void define(char op, int prec, bool rightAssoc = false) {
+        entries[static_cast<unsigned char>(op)] = {prec, rightAssoc};
+    }
+
+    /// The entry for a token from the lexer; keywords and other non-characters have none.
+    [[nodiscard]] Entry lookup(int tok) const {
+        if (tok < 0 || tok >= static_cast<int>(entries.size()))
+            return {};
+        return entries[tok];
+    }
+
+    /// Call fn(op, entry) for every binary operator.
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        for (unsigned c = 0; c < entries.size(); c++)
+            if (entries[c].prec > 0)
+                fn(static_cast<char>(c), entries[c]);
+    }
+
+private:
+    std::array<Entry, 256> entries{};
+};
+
+#endif //BINOP_HPP
@@ -1,9 +1,24 @@
+#include <cmath>
+#include <optional>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/bit.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Verifier.h>
-#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include "ast.hpp"
+#include "binop.hpp"
+#include "column.hpp"
+#include "debuginfo.hpp"
+#include "intrange.hpp"
+#include "memo.hpp"
+#include "registry.hpp"
+#include "ssa.hpp"
 #include "KaleidoscopeJIT.h"
 
 using namespace llvm;
@@ -13,21 +28,265 @@ using namespace AST;
 extern std::unique_ptr<LLVMContext> ctx;
 extern std::unique_ptr<IRBuilder<>> builder;
 extern std::unique_ptr<Module> module;
-extern std::unique_ptr<legacy::FunctionPassManager> fpm;
+extern std::unique_ptr<FunctionPassManager> fpm;
+extern std::unique_ptr<FunctionAnalysisManager> fam;
 extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
 
-static std::map<std::string, AllocaInst*> namedValues;
+static std::map<std::string, SSABuilder::Variable> namedValues;
+static SSABuilder ssa;
 extern std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
-extern std::map<char, int> binopPrec;
+extern BinopTable binops;
+extern std::map<std::string, std::unique_ptr<FunctionAST>> definitions;
+
+static cl::opt<unsigned> specializeBudget("specialize-budget",
+                                          cl::desc("AST nodes of callee bodies that may be cloned into one function "
+                                                   "to specialize calls on constant arguments (0 disables)"),
+                                          cl::init(200));
+
+static cl::opt<unsigned> selectCost("if-select-cost",
+                                    cl::desc("Largest combined cost of both arms of an if that is lowered to a "
+                                             "select instead of branches (0 disables)"),
+                                    cl::init(8));
+
+static cl::opt<bool> tailCalls("tail-calls",
+                               cl::desc("Return from calls in tail position with tail calls, musttail where the "
+                                        "signatures match, and turn self tail recursion into loops"),
+                               cl::init(true));
+
+namespace {
+    enum class Precision {
+        Double,
+        Single,
+    };
+}
+
+static cl::opt<Precision> precision(
+        "precision", cl::desc("Floating-point type numbers are computed in and definitions take and return"),
+        cl::init(Precision::Double),
+        cl::values(clEnumValN(Precision::Double, "double", "64-bit doubles"),
+                   clEnumValN(Precision::Single, "single", "32-bit floats; externs and the host still exchange "
+                                                           "doubles, converted at the call")));
+
+static cl::opt<bool> intArith("int-arith",
+                              cl::desc("Compute expressions and variables that only hold exact integers with i64 "
+                                       "arithmetic"), cl::init(true));
+
+/// What is left of specializeBudget for the function being compiled.
+static size_t specializeBudgetLeft;
+/// Definitions cloned into the function being compiled.
+static std::set<std::string> specializedCallees;
+
+/// The function being compiled, for the calls in tail position of its body.
+struct TailContext {
+    std::set<const CallExprAST*> calls;
+    Function* func = nullptr;
+    /// Where a call to func itself jumps back to, if the body makes one.
+    BasicBlock* header = nullptr;
+    /// The parameters' variables, and for those a clone has bound to a
+    /// constant, that constant.
+    std::vector<std::pair<SSABuilder::Variable, Value*>> params;
+};
+static TailContext tailContext;
 
 Value* logErrorV(const char* str) {
     fprintf(stderr, "Error: %s\n", str);
     return nullptr;
 }
 
-static AllocaInst* createEntryBlockAlloca(Function* func, const std::string &varName) {
-    IRBuilder<> tmpBuilder(&func->getEntryBlock(), func->getEntryBlock().begin());
-    return tmpBuilder.CreateAlloca(Type::getDoubleTy(*ctx), nullptr, varName);
+unsigned AST::numberBits() {
+    return precision == Precision::Single ? 32 : 64;
+}
+
+/// The type of numbers in definitions, as selected by --precision.
+static Type* numberTy() {
+    return precision == Precision::Single ? Type::getFloatTy(*ctx) : Type::getDoubleTy(*ctx);
+}
+
+/// Bits of numberTy's significand; integers up to 2^bits in magnitude are exact.
+static unsigned numberDigits() {
+    return APFloat::semanticsPrecision(numberTy()->getFltSemantics());
+}
+
+/// Integer ranges in the body being compiled, unless --int-arith is off.
+/// Expressions and variables with one are compiled to i64 values.
+static const IntInference* intRanges;
+
+static bool isInt(const ExprAST &expr) {
+    return intRanges && intRanges->of(expr);
+}
+
+static bool isIntBinding(const ExprAST &binder, unsigned index = 0) {
+    return intRanges && intRanges->ofBinding(binder, index);
+}
+
+/// Makes a body's integer ranges current until it goes out of scope, when
+/// those of the body it interrupted, if any, are restored.
+class IntRangeScope {
+public:
+    IntRangeScope(const ExprAST &body, const std::vector<std::string> &params,
+                  const std::vector<std::optional<double>> &constParams) : prev(intRanges) {
+        if (intArith)
+            ranges.emplace(body, params, constParams, numberDigits());
+        intRanges = ranges ? &*ranges : nullptr;
+    }
+
+    IntRangeScope(const IntRangeScope &) = delete;
+
+    ~IntRangeScope() { intRanges = prev; }
+
+private:
+    std::optional<IntInference> ranges;
+    const IntInference* prev;
+};
+
+/// The number an integer or floating-point value stands for.
+static Value* toNumber(Value* val) {
+    if (val->getType()->isIntegerTy())
+        return builder->CreateSIToFP(val, numberTy(), "tofp");
+    return val;
+}
+
+/// A branch condition testing val against zero.
+static Value* isNonZero(Value* val, const Twine &name) {
+    if (val->getType()->isIntegerTy())
+        return builder->CreateICmpNE(val, ConstantInt::get(val->getType(), 0), name);
+    return builder->CreateFCmpONE(val, ConstantFP::get(val->getType(), 0.0), name);
+}
+
+static void emitLocation(const ExprAST* expr) {
+    if (debugInfo)
+        debugInfo->emitLocation(expr, *builder);
+}
+
+/// Bind name to a new variable holding val, returning the binding it shadows.
+static std::optional<SSABuilder::Variable> bindVariable(const std::string &name, Value* val) {
+    auto var = ssa.newVariable(name, val->getType());
+    ssa.write(var, builder->GetInsertBlock(), val);
+    std::optional<SSABuilder::Variable> shadowed;
+    if (auto it = namedValues.find(name); it != namedValues.end())
+        shadowed = it->second;
+    namedValues[name] = var;
+    return shadowed;
+}
+
+static void unbindVariable(const std::string &name, std::optional<SSABuilder::Variable> shadowed) {
+    if (shadowed)
+        namedValues[name] = *shadowed;
+    else
+        namedValues.erase(name);
+}
+
+namespace {
+    struct MathIntrinsic {
+        Intrinsic::ID id;
+        unsigned arity;
+    };
+}
+
+/// libm functions with an LLVM intrinsic counterpart. Calls to them are emitted
+/// as the intrinsic, which the optimizer can fold, hoist and vectorize, and which
+/// the backend lowers back to the libm call (or an instruction) when needed.
+static const StringMap<MathIntrinsic> mathIntrinsics = {
+        {"sin",       {Intrinsic::sin,       1}},
+        {"cos",       {Intrinsic::cos,       1}},
+        {"exp",       {Intrinsic::exp,       1}},
+        {"exp2",      {Intrinsic::exp2,      1}},
+        {"log",       {Intrinsic::log,       1}},
+        {"log2",      {Intrinsic::log2,      1}},
+        {"log10",     {Intrinsic::log10,     1}},
+        {"sqrt",      {Intrinsic::sqrt,      1}},
+        {"fabs",      {Intrinsic::fabs,      1}},
+        {"floor",     {Intrinsic::floor,     1}},
+        {"ceil",      {Intrinsic::ceil,      1}},
+        {"trunc",     {Intrinsic::trunc,     1}},
+        {"round",     {Intrinsic::round,     1}},
+        {"rint",      {Intrinsic::rint,      1}},
+        {"nearbyint", {Intrinsic::nearbyint, 1}},
+        {"pow",       {Intrinsic::pow,       2}},
+        {"copysign",  {Intrinsic::copysign,  2}},
+        {"fmin",      {Intrinsic::minnum,    2}},
+        {"fmax",      {Intrinsic::maxnum,    2}},
+        {"fma",       {Intrinsic::fma,       3}},
+};
+
+/// The intrinsic to emit for a call to name, if it is an extern'd libm function
+/// (a Kaleidoscope def of the same name is left alone).
+static std::optional<Intrinsic::ID> mathIntrinsicFor(const std::string &name, unsigned arity) {
+    auto it = mathIntrinsics.find(name);
+    if (it == mathIntrinsics.end() || it->second.arity != arity || !isExternal(name))
+        return std::nullopt;
+    return it->second.id;
+}
+
+/// Lower a call to the column or columnLength built-ins to loads from the
+/// column table, with the same results for any argument: ids and indices are
+/// truncated, and an out-of-range index loads element 0 (or the empty column's
+/// placeholder) and yields NaN instead. nullptr if callee is not a built-in.
+static Value* columnAccess(const std::string &callee, ArrayRef<Value*> args) {
+    if (!isExternal(callee) || !((callee == "column" && args.size() == 2) ||
+                                 (callee == "columnLength" && args.size() == 1)))
+        return nullptr;
+    auto* doubleTy = Type::getDoubleTy(*ctx);
+    auto* i64 = Type::getInt64Ty(*ctx);
+    auto* columnTy = StructType::get(*ctx, {doubleTy->getPointerTo(), i64});
+    auto* tableTy = ArrayType::get(columnTy, maxColumns);
+    auto* table = module->getOrInsertGlobal("kaleidoscope_columns", tableTy);
+    // fptosi of NaN or a huge value is poison; frozen, it is some index that
+    // the unsigned range checks reject like any other.
+    auto toIndex = [](Value* v, const char* name) {
+        return builder->CreateFreeze(builder->CreateFPToSI(v, Type::getInt64Ty(*ctx)), name);
+    };
+    auto* id = toIndex(args[0], "colid");
+    auto* idOk = builder->CreateICmpULT(id, builder->getInt64(maxColumns));
+    id = builder->CreateSelect(idOk, id, builder->getInt64(0));
+    auto* entry = builder->CreateInBoundsGEP(tableTy, table, {builder->getInt64(0), id});
+    Value* length = builder->CreateLoad(i64, builder->CreateStructGEP(columnTy, entry, 1), "collen");
+    length = builder->CreateSelect(idOk, length, builder->getInt64(0));
+    if (callee == "columnLength")
+        return builder->CreateUIToFP(length, numberTy(), "collentmp");
+
+    auto* base = builder->CreateLoad(doubleTy->getPointerTo(), builder->CreateStructGEP(columnTy, entry, 0), "colbase");
+    auto* idx = toIndex(args[1], "colidx");
+    auto* inBounds = builder->CreateICmpULT(idx, length);
+    auto* safeIdx = builder->CreateSelect(inBounds, idx, builder->getInt64(0));
+    Value* val = builder->CreateLoad(doubleTy, builder->CreateInBoundsGEP(doubleTy, base, safeIdx), "colval");
+    val = builder->CreateFPCast(val, numberTy());
+    return builder->CreateSelect(inBounds, val, ConstantFP::getNaN(numberTy()), "coltmp");
+}
+
+/// Attach the inferred effects of name to its declaration or definition f.
+static void addEffectAttrs(Function &f, const std::string &name) {
+    auto fi = functionInfos.find(name);
+    if (fi == functionInfos.end())
+        return;
+    if (fi->second.readNone) {
+        f.setDoesNotAccessMemory();
+        f.setDoesNotThrow();
+    }
+    if (fi->second.willReturn)
+        f.addFnAttr(Attribute::WillReturn);
+    if (fi->second.noRecurse)
+        f.setDoesNotRecurse();
+}
+
+/// A clone of callee specialized on the constant arguments, when its
+/// definition is available and fits the remaining budget. Clones are shared
+/// by identical call sites in the module.
+static Function* specialize(const std::string &callee, const std::vector<std::optional<double>> &constArgs) {
+    // Clones have no debug scope of their own, and memoized calls must reach the table.
+    if (debugInfo || getMemoSize(callee))
+        return nullptr;
+    auto it = definitions.find(callee);
+    if (it == definitions.end())
+        return nullptr;
+    if (auto* f = module->getFunction(it->second->getSpecializationName(constArgs)))
+        return f;
+    size_t cost = countNodes(it->second->getBody());
+    if (cost > specializeBudgetLeft)
+        return nullptr;
+    specializeBudgetLeft -= cost;
+    specializedCallees.insert(callee);
+    return it->second->codegenSpecialization(constArgs);
 }
 
 Function* getFunction(const std::string &name) {
@@ -40,28 +299,33 @@ Function* getFunction(const std::string &name) {
 }
 
 Value* NumberExprAST::codegen() {
-    return ConstantFP::get(*ctx, APFloat(val));
+    emitLocation(this);
+    if (isInt(*this))
+        return builder->getInt64(static_cast<int64_t>(val));
+    return ConstantFP::get(numberTy(), val);
 }
 
 Value* VariableExprAST::codegen() {
-    Value* v = namedValues[name];
-    if (!v) {
-        logErrorV("Unknown variable name");
-    }
-    return builder->CreateLoad(Type::getDoubleTy(*ctx), v, name);
+    emitLocation(this);
+    auto it = namedValues.find(name);
+    if (it == namedValues.end())
+        return logErrorV("Unknown variable name");
+    return ssa.read(it->second, builder->GetInsertBlock());
 }
 
 Value* UnaryExprAST::codegen() {
+    emitLocation(this);
     Value* operandV = operand->codegen();
     if (!operandV)
         return nullptr;
     Function* f = getFunction(std::string("unary") + opCode);
     if (!f)
         return logErrorV("Unknown unary op");
-    return builder->CreateCall(f, operandV, "unop");
+    return builder->CreateCall(f, toNumber(operandV), "unop");
 }
 
 Value* BinaryExprAST::codegen() {
+    emitLocation(this);
     if (op == '=') {
         auto* lhse = dynamic_cast<VariableExprAST*>(lhs.get());
         if (!lhse)
@@ -69,66 +333,73 @@ Value* BinaryExprAST::codegen() {
         Value* val = rhs->codegen();
         if (!val)
             return nullptr;
-        Value *var = namedValues[lhse->getName()];
-        if (!var)
+        auto it = namedValues.find(lhse->getName());
+        if (it == namedValues.end())
             return logErrorV("Unknown var");
-        builder->CreateStore(val, var);
+        // An integer variable is only ever assigned integers.
+        bool intVar = ssa.getType(it->second)->isIntegerTy();
+        ssa.write(it->second, builder->GetInsertBlock(), intVar ? val : toNumber(val));
         return val;
     }
     Value* l = lhs->codegen();
     Value* r = rhs->codegen();
     if (!l || !r)
         return nullptr;
+    // The ranges of integer operands and results are within ±2^53 (2^24 in
+    // single precision), so the integer operations cannot overflow.
+    bool ints = l->getType()->isIntegerTy() && r->getType()->isIntegerTy();
     switch (op) {
         case '+':
-            return builder->CreateFAdd(l, r, "addtmp");
+            if (isInt(*this))
+                return builder->CreateAdd(l, r, "addtmp", false, true);
+            return builder->CreateFAdd(toNumber(l), toNumber(r), "addtmp");
         case '-':
-            return builder->CreateFSub(l, r, "subtmp");
+            if (isInt(*this))
+                return builder->CreateSub(l, r, "subtmp", false, true);
+            return builder->CreateFSub(toNumber(l), toNumber(r), "subtmp");
         case '*':
-            return builder->CreateFMul(l, r, "multmp");
+            if (isInt(*this))
+                return builder->CreateMul(l, r, "multmp", false, true);
+            return builder->CreateFMul(toNumber(l), toNumber(r), "multmp");
         case '<':
-            l = builder->CreateFCmpULT(l, r, "cmptmp");
-            return builder->CreateUIToFP(l, Type::getDoubleTy(*ctx), "bool");
+            l = ints ? builder->CreateICmpSLT(l, r, "cmptmp")
+                     : builder->CreateFCmpULT(toNumber(l), toNumber(r), "cmptmp");
+            if (isInt(*this))
+                return builder->CreateZExt(l, builder->getInt64Ty(), "bool");
+            return builder->CreateUIToFP(l, numberTy(), "bool");
         default:
             break;
     }
     Function* f = getFunction(std::string("binary") + op);
     assert(f && "binary op not found");
-    Value* ops[2] = {l, r};
+    Value* ops[2] = {toNumber(l), toNumber(r)};
     return builder->CreateCall(f, ops, "binop");
 }
 Value* VarExprAST::codegen() {
-    std::vector<AllocaInst*> shadowed;
-    Function *func = builder->GetInsertBlock()->getParent();
-    for(const auto&[varName, init]:varNames) {
+    emitLocation(this);
+    std::vector<std::optional<SSABuilder::Variable>> shadowed;
+    for (unsigned i = 0; i < varNames.size(); i++) {
+        auto &[varName, init] = varNames[i];
         Value* initVal;
         if (init) {
             initVal = init->codegen();
             if (!initVal)
                 return nullptr;
         } else {
-            initVal = ConstantFP::get(*ctx, APFloat(0.0));
+            initVal = builder->getInt64(0);
         }
-        auto* alloca = createEntryBlockAlloca(func, varName);
-        builder->CreateStore(initVal, alloca);
-
-        shadowed.push_back(namedValues[varName]);
-        namedValues[varName] = alloca;
+        shadowed.push_back(bindVariable(varName, isIntBinding(*this, i) ? initVal : toNumber(initVal)));
     }
     Value * bodyVal = body->codegen();
     if (!bodyVal)
         return nullptr;
 
-    for(unsigned i = 0; i< varNames.size(); ++i) {
-        auto *old = shadowed[i];
-        if (old)
-            namedValues[varNames[i].first] = old;
-        else
-            namedValues.erase(varNames[i].first);
-    }
+    for(unsigned i = 0; i< varNames.size(); ++i)
+        unbindVariable(varNames[i].first, shadowed[i]);
     return bodyVal;
 }
 Value* CallExprAST::codegen() {
+    emitLocation(this);
     Function* calleeFunc = getFunction(callee);
     if (!calleeFunc)
         return logErrorV("Unknown function referenced");
@@ -139,25 +410,127 @@ Value* CallExprAST::codegen() {
         argsV.push_back(arg->codegen());
         if (!argsV.back())
             return nullptr;
+        argsV.back() = toNumber(argsV.back());
+    }
+    if (auto* val = columnAccess(callee, argsV))
+        return val;
+    if (auto id = mathIntrinsicFor(callee, args.size()))
+        return builder->CreateIntrinsic(*id, {numberTy()}, argsV, nullptr, "calltmp");
+    // Externs take doubles whatever the precision.
+    for (size_t i = 0; i < args.size(); i++)
+        argsV[i] = builder->CreateFPCast(argsV[i], calleeFunc->getArg(i)->getType());
+
+    std::vector<std::optional<double>> constArgs;
+    for (auto &arg: args) {
+        auto* num = dynamic_cast<NumberExprAST*>(arg.get());
+        constArgs.push_back(num ? std::optional(num->getVal()) : std::nullopt);
+    }
+    Function* target = calleeFunc;
+    std::vector<Value*> targetArgs = argsV;
+    if (any_of(constArgs, [](auto &c) { return c.has_value(); }))
+        if (auto* spec = specialize(callee, constArgs)) {
+            target = spec;
+            targetArgs.clear();
+            for (size_t i = 0; i < args.size(); i++)
+                if (!constArgs[i])
+                    targetArgs.push_back(argsV[i]);
+        }
+    if (tailContext.calls.count(this))
+        return codegenTailCall(target, argsV, targetArgs);
+    return builder->CreateFPCast(builder->CreateCall(target, targetArgs, "calltmp"), numberTy());
+}
+
+/// Return the call's value from the function being compiled. A call to that
+/// function itself rebinds the parameters and jumps back to the top of the
+/// body, while other calls are emitted as musttail where the signatures match
+/// so the backend must reuse the caller's frame, and as tail otherwise.
+/// Whatever follows the call in the AST, which only passes its value on to
+/// the return, is emitted into a block that is never reached.
+Value* CallExprAST::codegenTailCall(Function* target, ArrayRef<Value*> argsV, ArrayRef<Value*> targetArgs) {
+    Function* func = builder->GetInsertBlock()->getParent();
+    if (target == tailContext.func && tailContext.header) {
+        for (size_t i = 0; i < argsV.size(); i++) {
+            auto [var, fixed] = tailContext.params[i];
+            ssa.write(var, builder->GetInsertBlock(), fixed ? fixed : argsV[i]);
+        }
+        builder->CreateBr(tailContext.header);
+    } else {
+        auto* call = builder->CreateCall(target, targetArgs, "calltmp");
+        call->setTailCallKind(target->getFunctionType() == func->getFunctionType() ? CallInst::TCK_MustTail
+                                                                                    : CallInst::TCK_Tail);
+        builder->CreateRet(builder->CreateFPCast(call, func->getReturnType()));
+    }
+    auto* deadBB = BasicBlock::Create(*ctx, "aftertail", func);
+    builder->SetInsertPoint(deadBB);
+    ssa.seal(deadBB);
+    return UndefValue::get(numberTy());
+}
+
+/// Add to cost what evaluating expr unconditionally would, roughly in
+/// instructions. Returns false if expr must not be speculated: it assigns,
+/// loops, or calls anything but a pure libm function.
+static bool addSpeculationCost(const ExprAST &expr, unsigned &cost) {
+    if (auto* bin = dynamic_cast<const BinaryExprAST*>(&expr)) {
+        char op = bin->getOp();
+        if (op != '+' && op != '-' && op != '*' && op != '<')
+            return false;
+        cost += 1;
+    } else if (auto* call = dynamic_cast<const CallExprAST*>(&expr)) {
+        if (!isExternal(call->getCallee()) || !isPureLibmFunction(call->getCallee()))
+            return false;
+        cost += 4;
+    } else if (!dynamic_cast<const NumberExprAST*>(&expr) && !dynamic_cast<const VariableExprAST*>(&expr) &&
+               !dynamic_cast<const VarExprAST*>(&expr) && !dynamic_cast<const IfExprAST*>(&expr)) {
+        return false;
     }
-    return builder->CreateCall(calleeFunc, argsV, "calltmp");
+    bool ok = true;
+    expr.forEachChild([&](const ExprAST &child) { ok = ok && addSpeculationCost(child, cost); });
+    return ok;
+}
+
+/// Both arms are cheap and side-effect free, so evaluating both and selecting
+/// costs less than a branch the CPU may mispredict, and leaves the enclosing
+/// loop a single block the vectorizer can handle.
+bool IfExprAST::isSelect() const {
+    unsigned cost = 0;
+    return selectCost && addSpeculationCost(*then, cost) && addSpeculationCost(*else_, cost) && cost <= selectCost;
 }
 
 Value* IfExprAST::codegen() {
+    emitLocation(this);
     Value* condV = cond->codegen();
     if (!condV)
         return nullptr;
-    condV = builder->CreateFCmpONE(condV, ConstantFP::get(*ctx, APFloat(0.0)), "ifcond");
+    condV = isNonZero(condV, "ifcond");
+    // Both arms are integers if the if is one, and are converted otherwise.
+    bool intIf = isInt(*this);
+    if (isSelect()) {
+        Value* thenV = then->codegen();
+        if (!thenV)
+            return nullptr;
+        Value* elseV = else_->codegen();
+        if (!elseV)
+            return nullptr;
+        if (!intIf) {
+            thenV = toNumber(thenV);
+            elseV = toNumber(elseV);
+        }
+        return builder->CreateSelect(condV, thenV, elseV, "iftmp");
+    }
 
     Function* func = builder->GetInsertBlock()->getParent();
     BasicBlock* thenBB = BasicBlock::Create(*ctx, "then", func);
     BasicBlock* elseBB = BasicBlock::Create(*ctx, "else");
     BasicBlock* mergeBB = BasicBlock::Create(*ctx, "ifcont");
     builder->CreateCondBr(condV, thenBB, elseBB);
+    ssa.seal(thenBB);
+    ssa.seal(elseBB);
     builder->SetInsertPoint(thenBB);
     Value* thenV = then->codegen();
     if (!thenV)
         return nullptr;
+    if (!intIf)
+        thenV = toNumber(thenV);
     builder->CreateBr(mergeBB);
     thenBB = builder->GetInsertBlock();
 
@@ -166,34 +539,270 @@ Value* IfExprAST::codegen() {
     Value* elseV = else_->codegen();
     if (!elseV)
         return nullptr;
+    if (!intIf)
+        elseV = toNumber(elseV);
     builder->CreateBr(mergeBB);
     elseBB = builder->GetInsertBlock();
 
     func->getBasicBlockList().push_back(mergeBB);
+    ssa.seal(mergeBB);
     builder->SetInsertPoint(mergeBB);
-    PHINode* pn = builder->CreatePHI(Type::getDoubleTy(*ctx), 2, "iftmp");
+    PHINode* pn = builder->CreatePHI(thenV->getType(), 2, "iftmp");
     pn->addIncoming(thenV, thenBB);
     pn->addIncoming(elseV, elseBB);
     return pn;
 }
 
+/// Calls whose value expr evaluates to as is: expr itself, or one in tail
+/// position of the arms of an if lowered to branches or of a var's body.
+static void collectTailCalls(const ExprAST &expr, std::set<const CallExprAST*> &calls) {
+    if (auto* call = dynamic_cast<const CallExprAST*>(&expr)) {
+        calls.insert(call);
+    } else if (auto* ifExpr = dynamic_cast<const IfExprAST*>(&expr); ifExpr && !ifExpr->isSelect()) {
+        collectTailCalls(ifExpr->getThen(), calls);
+        collectTailCalls(ifExpr->getElse(), calls);
+    } else if (auto* var = dynamic_cast<const VarExprAST*>(&expr)) {
+        collectTailCalls(var->getBody(), calls);
+    }
+}
+
+/// Start compiling body into func, whose entry block is current and has its
+/// parameters bound. If body calls func itself in tail position, the body
+/// goes into a loop header the calls jump back to, which is sealed by
+/// endTailContext.
+static void beginTailContext(Function* func, const ExprAST &body, const std::string &name,
+                             std::vector<std::pair<SSABuilder::Variable, Value*>> params) {
+    tailContext = {};
+    if (!tailCalls)
+        return;
+    collectTailCalls(body, tailContext.calls);
+    tailContext.func = func;
+    tailContext.params = std::move(params);
+    if (none_of(tailContext.calls, [&](auto* call) { return call->getCallee() == name; }))
+        return;
+    tailContext.header = BasicBlock::Create(*ctx, "tailrecurse", func);
+    builder->CreateBr(tailContext.header);
+    builder->SetInsertPoint(tailContext.header);
+}
+
+static void endTailContext() {
+    if (tailContext.header)
+        ssa.seal(tailContext.header);
+}
+
+/// Names assigned anywhere in expr, whichever binding they refer to.
+static void collectAssigned(const ExprAST &expr, std::set<std::string> &assigned) {
+    if (auto* bin = dynamic_cast<const BinaryExprAST*>(&expr); bin && bin->getOp() == '=')
+        if (auto* var = dynamic_cast<const VariableExprAST*>(&bin->getLHS()))
+            assigned.insert(var->getName());
+    expr.forEachChild([&](const ExprAST &child) { collectAssigned(child, assigned); });
+}
+
+/// expr is built from constants, variables not in `changing` and builtin
+/// arithmetic, so it has the same value every time it is evaluated in the loop.
+static bool isLoopInvariant(const ExprAST &expr, const std::set<std::string> &changing) {
+    if (dynamic_cast<const NumberExprAST*>(&expr))
+        return true;
+    if (auto* var = dynamic_cast<const VariableExprAST*>(&expr))
+        return !changing.count(var->getName());
+    auto* bin = dynamic_cast<const BinaryExprAST*>(&expr);
+    if (!bin || (bin->getOp() != '+' && bin->getOp() != '-' && bin->getOp() != '*' && bin->getOp() != '<'))
+        return false;
+    return isLoopInvariant(bin->getLHS(), changing) && isLoopInvariant(bin->getRHS(), changing);
+}
+
+/// expr is an integer constant small enough that adding it to another such integer
+/// in double precision, as the loop does, is exact.
+static bool isExactInteger(const ExprAST* expr, double lo, double hi) {
+    auto* num = dynamic_cast<const NumberExprAST*>(expr);
+    return num && num->getVal() == std::trunc(num->getVal()) && num->getVal() >= lo && num->getVal() <= hi;
+}
+
+/// The accumulator of a reducing loop, holding the reduction's identity on entry.
+static std::optional<SSABuilder::Variable> beginReduction(ForExprAST::Reduction reduction) {
+    double identity;
+    switch (reduction) {
+        case ForExprAST::Reduction::None:
+            return std::nullopt;
+        case ForExprAST::Reduction::Sum:
+            identity = 0.0;
+            break;
+        case ForExprAST::Reduction::Product:
+            identity = 1.0;
+            break;
+        case ForExprAST::Reduction::Min:
+            identity = INFINITY;
+            break;
+        case ForExprAST::Reduction::Max:
+            identity = -INFINITY;
+            break;
+    }
+    auto acc = ssa.newVariable("acc", numberTy());
+    ssa.write(acc, builder->GetInsertBlock(), ConstantFP::get(numberTy(), identity));
+    return acc;
+}
+
+/// Fold one iteration's body value into the accumulator. Only the combining
+/// operation may be reassociated, which is what lets the vectorizer keep
+/// partial accumulators per lane and combine them after the loop; the body
+/// itself keeps strict IEEE semantics. min and max ignore NaNs, like fmin and
+/// fmax, and so are exact in any order.
+static void accumulate(ForExprAST::Reduction reduction, std::optional<SSABuilder::Variable> acc, Value* val) {
+    if (!acc)
+        return;
+    val = toNumber(val);
+    Value* cur = ssa.read(*acc, builder->GetInsertBlock());
+    FastMathFlags fmf;
+    fmf.setAllowReassoc();
+    Value* next;
+    switch (reduction) {
+        case ForExprAST::Reduction::Sum:
+            next = builder->CreateFAdd(cur, val, "acc.next");
+            break;
+        case ForExprAST::Reduction::Product:
+            next = builder->CreateFMul(cur, val, "acc.next");
+            break;
+        case ForExprAST::Reduction::Min:
+            next = builder->CreateBinaryIntrinsic(Intrinsic::minnum, cur, val, nullptr, "acc.next");
+            break;
+        default:
+            next = builder->CreateBinaryIntrinsic(Intrinsic::maxnum, cur, val, nullptr, "acc.next");
+            break;
+    }
+    if (auto* inst = dyn_cast<Instruction>(next))
+        inst->setFastMathFlags(fmf);
+    ssa.write(*acc, builder->GetInsertBlock(), next);
+}
+
+/// The loop's value in the block after it.
+static Value* endReduction(std::optional<SSABuilder::Variable> acc, bool isInt) {
+    if (!acc)
+        return Constant::getNullValue(isInt ? builder->getInt64Ty() : numberTy());
+    return ssa.read(*acc, builder->GetInsertBlock());
+}
+
+/// Loop metadata telling LLVM the loop terminates, so it may be deleted or
+/// rewritten even when the optimizer cannot prove its trip count finite.
+static MDNode* mustProgressLoopID() {
+    auto* loopID = MDNode::getDistinct(*ctx, {nullptr, MDNode::get(*ctx, MDString::get(*ctx, "llvm.loop.mustprogress"))});
+    loopID->replaceOperandWith(0, loopID);
+    return loopID;
+}
+
+bool ForExprAST::isCounted() const {
+    double maxStart = std::ldexp(1.0, static_cast<int>(numberDigits()) - 1);
+    if (!isExactInteger(start.get(), -maxStart, maxStart) || (step && !isExactInteger(step.get(), 1, 0x1p31)))
+        return false;
+    auto* cmp = dynamic_cast<const BinaryExprAST*>(end.get());
+    if (!cmp || cmp->getOp() != '<')
+        return false;
+    auto* iv = dynamic_cast<const VariableExprAST*>(&cmp->getLHS());
+    if (!iv || iv->getName() != varName)
+        return false;
+    std::set<std::string> changing;
+    collectAssigned(*body, changing);
+    if (changing.count(varName))
+        return false;
+    changing.insert(varName);
+    return isLoopInvariant(cmp->getRHS(), changing);
+}
+
+/// Lower "for i = a, i < n, s in body" with an i64 counter k and i = a + k*s,
+/// which is exactly the double the source loop computes by repeated addition.
+/// The body runs once, then again while i < n held after it, so it runs
+/// kExit + 1 times where kExit is the first k with !(a + k*s < n). kExit is
+/// computed up front, making the trip count visible to SCEV, LICM, the
+/// unroller and the vectorizer. In single precision it is computed on the
+/// bound converted to double, and i is the float nearest a + k*s, which is
+/// what repeated float addition gives as long as it is exact.
+Value* ForExprAST::codegenCounted() {
+    Function* func = builder->GetInsertBlock()->getParent();
+    auto* doubleTy = Type::getDoubleTy(*ctx);
+    auto* i64 = Type::getInt64Ty(*ctx);
+    double a = static_cast<const NumberExprAST &>(*start).getVal();
+    double s = step ? static_cast<const NumberExprAST &>(*step).getVal() : 1.0;
+    Value* n = static_cast<BinaryExprAST &>(*end).getRHS().codegen();
+    if (!n)
+        return nullptr;
+    n = builder->CreateFPCast(toNumber(n), doubleTy);
+
+    // Estimate kExit by division, then correct it by one either way with the
+    // same comparison the source loop makes, which is exact on a + k*s. kExit
+    // is capped at kMax, the last k with a + k*s <= 2^53: past it the double
+    // induction variable stops advancing or rounds, and the cap keeps every
+    // a + k*s computed here and in the loop well within i64. A NaN bound never
+    // fails '<' (it is an unordered compare), so that loop runs to the cap.
+    auto* aV = ConstantFP::get(doubleTy, a);
+    auto* sV = ConstantFP::get(doubleTy, s);
+    int64_t kMax = ((int64_t(1) << 53) - static_cast<int64_t>(a)) / static_cast<int64_t>(s);
+    auto intValueAt = [&](Value* k) {
+        return builder->CreateAdd(builder->CreateMul(k, ConstantInt::get(i64, (int64_t) s), "", false, true),
+                                  ConstantInt::get(i64, (int64_t) a), "", false, true);
+    };
+    auto valueAt = [&](Value* k, Type* type) { return builder->CreateSIToFP(intValueAt(k), type); };
+    Value* est = builder->CreateUnaryIntrinsic(Intrinsic::ceil, builder->CreateFDiv(builder->CreateFSub(n, aV), sV));
+    est = builder->CreateBinaryIntrinsic(Intrinsic::maxnum, est, ConstantFP::get(doubleTy, 0.0));
+    est = builder->CreateBinaryIntrinsic(Intrinsic::minnum, est, ConstantFP::get(doubleTy, static_cast<double>(kMax)));
+    Value* kExit = builder->CreateFPToSI(est, i64, "kexit.est");
+    kExit = builder->CreateSelect(builder->CreateFCmpULT(valueAt(kExit, doubleTy), n), builder->CreateAdd(kExit, builder->getInt64(1)),
+                                  kExit);
+    auto* prev = builder->CreateSub(kExit, builder->getInt64(1));
+    kExit = builder->CreateSelect(builder->CreateAnd(builder->CreateICmpSGT(kExit, builder->getInt64(0)),
+                                                     builder->CreateNot(builder->CreateFCmpULT(valueAt(prev, doubleTy), n))),
+                                  prev, kExit);
+    kExit = builder->CreateBinaryIntrinsic(Intrinsic::smin, kExit, builder->getInt64(kMax));
+    kExit = builder->CreateSelect(builder->CreateFCmpUNO(n, n), builder->getInt64(kMax), kExit, "kexit");
+    auto* trips = builder->CreateAdd(kExit, builder->getInt64(1), "trips");
+
+    auto acc = beginReduction(reduction);
+    auto* preheader = builder->GetInsertBlock();
+    BasicBlock* loopBB = BasicBlock::Create(*ctx, "loop", func);
+    builder->CreateBr(loopBB);
+    builder->SetInsertPoint(loopBB);
+    auto* k = builder->CreatePHI(i64, 2, "k");
+    k->addIncoming(builder->getInt64(0), preheader);
+    auto shadowed = bindVariable(varName, isIntBinding(*this) ? intValueAt(k) : valueAt(k, numberTy()));
+
+    Value* bodyV = body->codegen();
+    if (!bodyV)
+        return nullptr;
+    accumulate(reduction, acc, bodyV);
+
+    auto* next = builder->CreateAdd(k, builder->getInt64(1), "k.next", true, true);
+    k->addIncoming(next, builder->GetInsertBlock());
+    BasicBlock* afterBB = BasicBlock::Create(*ctx, "afterloop", func);
+    auto* latch = builder->CreateCondBr(builder->CreateICmpNE(next, trips, "loopcond"), loopBB, afterBB);
+    latch->setMetadata(LLVMContext::MD_loop, mustProgressLoopID());
+    ssa.seal(loopBB);
+    ssa.seal(afterBB);
+    builder->SetInsertPoint(afterBB);
+    unbindVariable(varName, shadowed);
+    return endReduction(acc, isInt(*this));
+}
+
 Value* ForExprAST::codegen() {
+    emitLocation(this);
+    if (isCounted())
+        return codegenCounted();
     Function* func = builder->GetInsertBlock()->getParent();
-    AllocaInst *alloca = createEntryBlockAlloca(func, varName);
     Value* startV = start->codegen();
     if (!startV)
         return nullptr;
-    builder->CreateStore(startV, alloca);
+    // An integer loop variable only ever has integer steps added.
+    bool intVar = isIntBinding(*this);
+    auto shadowed = bindVariable(varName, intVar ? startV : toNumber(startV));
+    auto var = namedValues[varName];
+    auto acc = beginReduction(reduction);
     BasicBlock* loopBB = BasicBlock::Create(*ctx, "loop", func);
     builder->CreateBr(loopBB);
 
+    // The loop header stays unsealed until the back edge exists.
     builder->SetInsertPoint(loopBB);
 
-    AllocaInst* shadowedVal = namedValues[varName];
-    namedValues[varName] = alloca;
-
-    if (!body->codegen())
+    Value* bodyV = body->codegen();
+    if (!bodyV)
         return nullptr;
+    accumulate(reduction, acc, bodyV);
 
     Value* stepV;
     if (step) {
@@ -201,64 +810,284 @@ Value* ForExprAST::codegen() {
         if (!stepV)
             return nullptr;
     } else {
-        stepV = ConstantFP::get(*ctx, APFloat(1.0));
+        stepV = builder->getInt64(1);
     }
     Value* endV = end->codegen();
     if (!endV)
         return nullptr;
 
-    Value* curVar = builder->CreateLoad(alloca->getAllocatedType(), alloca, varName);
-    Value* nextVar = builder->CreateFAdd(curVar, stepV, "nextvar");
-    builder->CreateStore(nextVar, alloca);
+    Value* curVar = ssa.read(var, builder->GetInsertBlock());
+    Value* nextVar = intVar ? builder->CreateAdd(curVar, stepV, "nextvar", false, true)
+                            : builder->CreateFAdd(curVar, toNumber(stepV), "nextvar");
+    ssa.write(var, builder->GetInsertBlock(), nextVar);
 
-    endV = builder->CreateFCmpONE(endV, ConstantFP::get(*ctx, APFloat(0.0)), "loopcond");
+    endV = isNonZero(endV, "loopcond");
 
     BasicBlock* afterBB = BasicBlock::Create(*ctx, "afterloop", func);
     builder->CreateCondBr(endV, loopBB, afterBB);
+    ssa.seal(loopBB);
+    ssa.seal(afterBB);
     builder->SetInsertPoint(afterBB);
-    if (shadowedVal)
-        namedValues[varName] = shadowedVal;
-    else
-        namedValues.erase(varName);
-    return Constant::getNullValue(Type::getDoubleTy(*ctx));
+    unbindVariable(varName, shadowed);
+    return endReduction(acc, isInt(*this));
 }
 
 Function* PrototypeAST::codegen() {
-    std::vector<Type*> doubles(args.size(), Type::getDoubleTy(*ctx));
-    FunctionType* ft = FunctionType::get(Type::getDoubleTy(*ctx), doubles, false);
+    // Externs are C functions and top-level expressions are called by the
+    // host, both with doubles; definitions use numberTy.
+    Type* ty = isExternal(name) || name == "__anon_expr" ? Type::getDoubleTy(*ctx) : numberTy();
+    std::vector<Type*> params(args.size(), ty);
+    FunctionType* ft = FunctionType::get(ty, params, false);
     Function* f = Function::Create(ft, Function::ExternalLinkage, name, module.get());
 
     unsigned idx = 0;
     for (auto &arg:f->args()) {
         arg.setName(args[idx++]);
     }
+    // Declarations in every module carry the callee's inferred effects, so calls
+    // to it can be CSE'd and hoisted wherever they are compiled.
+    addEffectAttrs(*f, name);
     return f;
 }
 
+/// Fill in func as a wrapper that returns body's result for its arguments from
+/// the memo table if present, and otherwise calls body and records the result.
+/// The table holds doubles whatever the precision.
+static void emitMemoWrapper(Function &func, Function &body) {
+    auto* doubleTy = Type::getDoubleTy(*ctx);
+    auto* doublePtrTy = doubleTy->getPointerTo();
+    auto* tablePtrTy = Type::getInt8PtrTy(*ctx);
+    // The table's symbol addresses the table itself.
+    auto* table = module->getOrInsertGlobal(createMemoTable(func.getName().str(), func.arg_size()),
+                                            Type::getInt8Ty(*ctx));
+    auto lookup = module->getOrInsertFunction("kaleidoscope_memo_lookup", Type::getInt8Ty(*ctx), tablePtrTy,
+                                              doublePtrTy, doublePtrTy);
+    auto store = module->getOrInsertFunction("kaleidoscope_memo_store", Type::getVoidTy(*ctx), tablePtrTy,
+                                             doublePtrTy, doubleTy);
+    // The wrapper reads and writes the table, unlike the function it stands for.
+    func.removeFnAttr(Attribute::ReadNone);
+
+    IRBuilder<> b(BasicBlock::Create(*ctx, "entry", &func));
+    auto* argsTy = ArrayType::get(doubleTy, std::max<size_t>(func.arg_size(), 1));
+    auto* args = b.CreateAlloca(argsTy, nullptr, "args");
+    std::vector<Value*> argsV;
+    for (auto &arg: func.args()) {
+        b.CreateStore(b.CreateFPCast(&arg, doubleTy), b.CreateConstInBoundsGEP2_32(argsTy, args, 0, arg.getArgNo()));
+        argsV.push_back(&arg);
+    }
+    auto* cached = b.CreateAlloca(doubleTy, nullptr, "cached");
+    auto* argsPtr = b.CreateConstInBoundsGEP2_32(argsTy, args, 0, 0);
+    auto* hit = b.CreateICmpNE(b.CreateCall(lookup, {table, argsPtr, cached}), b.getInt8(0), "hit");
+    auto* hitBB = BasicBlock::Create(*ctx, "hit", &func);
+    auto* missBB = BasicBlock::Create(*ctx, "miss", &func);
+    b.CreateCondBr(hit, hitBB, missBB);
+    b.SetInsertPoint(hitBB);
+    b.CreateRet(b.CreateFPCast(b.CreateLoad(doubleTy, cached, "cachedval"), func.getReturnType()));
+    b.SetInsertPoint(missBB);
+    auto* val = b.CreateCall(&body, argsV, "val");
+    b.CreateCall(store, {table, argsPtr, b.CreateFPCast(val, doubleTy)});
+    b.CreateRet(val);
+}
+
 Function* FunctionAST::codegen() {
     auto &p = *proto;
-    functionProtos[p.getName()] = std::move(proto);
+    functionProtos[p.getName()] = std::make_unique<PrototypeAST>(p);
     Function* func = getFunction(p.getName());
 
     if (!func)
         return nullptr;
     if (p.isBinaryOp()) {
-        binopPrec[p.getOperatorName()] = p.getBinaryPrecedence();
+        binops.define(p.getOperatorName(), static_cast<int>(p.getBinaryPrecedence()));
+    }
+    // A memoized function's body goes into an internal function behind a
+    // wrapper that consults the memo table. Recursive calls, direct or through
+    // other functions, reach the wrapper again.
+    Function* bodyFunc = func;
+    if (getMemoSize(p.getName())) {
+        auto fi = functionInfos.find(p.getName());
+        if (fi != functionInfos.end() && fi->second.readNone) {
+            bodyFunc = Function::Create(func->getFunctionType(), Function::InternalLinkage, p.getName() + ".body",
+                                        module.get());
+            bodyFunc->copyAttributesFrom(func);
+            for (auto &arg: bodyFunc->args())
+                arg.setName(func->getArg(arg.getArgNo())->getName());
+        } else {
+            fprintf(stderr, "Warning: %s may have side effects, not memoizing it\n", p.getName().c_str());
+        }
     }
-    BasicBlock* bb = BasicBlock::Create(*ctx, "entry", func);
+    specializeBudgetLeft = specializeBudget;
+    specializedCallees.clear();
+    BasicBlock* bb = BasicBlock::Create(*ctx, "entry", bodyFunc);
     builder->SetInsertPoint(bb);
+    if (debugInfo)
+        debugInfo->beginFunction(*bodyFunc, p, *builder);
     namedValues.clear();
-    for (auto &arg: func->args()) {
-        auto* alloca = createEntryBlockAlloca(func, arg.getName().str());
-        builder->CreateStore(&arg, alloca);
-        namedValues[arg.getName().str()] = alloca;
+    ssa.clear();
+    ssa.seal(bb);
+    std::vector<std::pair<SSABuilder::Variable, Value*>> params;
+    // Parameters are bound by the prototype's names: a context that discards
+    // value names (--low-latency) leaves the arguments unnamed.
+    for (auto &arg: bodyFunc->args()) {
+        auto &argName = p.getArgs()[arg.getArgNo()];
+        if (debugInfo)
+            debugInfo->declareParam(arg, arg.getArgNo() + 1, p.getLine(), *builder);
+        bindVariable(argName, &arg);
+        params.emplace_back(namedValues[argName], nullptr);
     }
+    // Recursive calls of a memoized function reach the wrapper, never bodyFunc.
+    beginTailContext(bodyFunc, *body, bodyFunc == func ? p.getName() : "", std::move(params));
+    IntRangeScope ranges(*body, p.getArgs(), {});
     if (Value* retval = body->codegen()) {
-        builder->CreateRet(retval);
-        verifyFunction(*func);
-        fpm->run(*func);
+        builder->CreateRet(builder->CreateFPCast(toNumber(retval), bodyFunc->getReturnType()));
+        endTailContext();
+        verifyFunction(*bodyFunc);
+        fpm->run(*bodyFunc, *fam);
+        if (bodyFunc != func) {
+            emitMemoWrapper(*func, *bodyFunc);
+            verifyFunction(*func);
+            fpm->run(*func, *fam);
+        }
+        // Only registered definitions are tracked; top-level expressions are not.
+        if (auto info = functionInfos.find(p.getName()); info != functionInfos.end())
+            info->second.specialized = specializedCallees;
         return func;
     }
+    if (bodyFunc != func)
+        bodyFunc->eraseFromParent();
     func->eraseFromParent();
     return nullptr;
 }
+
+std::string FunctionAST::getSpecializationName(const std::vector<std::optional<double>> &constArgs) const {
+    std::string name = proto->getName() + ".spec";
+    for (auto &c: constArgs)
+        name += c ? "." + utohexstr(bit_cast<uint64_t>(*c)) : ".x";
+    return name;
+}
+
+Function* FunctionAST::codegenSpecialization(const std::vector<std::optional<double>> &constArgs) {
+    auto &p = *proto;
+    auto name = getSpecializationName(constArgs);
+
+    size_t numDyn = count_if(constArgs, [](auto &c) { return !c.has_value(); });
+    std::vector<Type*> numbers(numDyn, numberTy());
+    FunctionType* ft = FunctionType::get(numberTy(), numbers, false);
+    Function* f = Function::Create(ft, Function::InternalLinkage, name, module.get());
+    addEffectAttrs(*f, p.getName());
+
+    // The clone is generated in the middle of the caller's body.
+    IRBuilderBase::InsertPointGuard guard(*builder);
+    auto callerTail = std::move(tailContext);
+    auto callerValues = std::move(namedValues);
+    namedValues.clear();
+    builder->SetInsertPoint(BasicBlock::Create(*ctx, "entry", f));
+    ssa.seal(builder->GetInsertBlock());
+    IntRangeScope ranges(*body, p.getArgs(), constArgs);
+    std::vector<std::pair<SSABuilder::Variable, Value*>> params;
+    auto dynArg = f->arg_begin();
+    for (size_t i = 0; i < constArgs.size(); i++) {
+        auto &argName = p.getArgs()[i];
+        Value* val;
+        if (constArgs[i] && intRanges && intRanges->ofParam(i)) {
+            val = builder->getInt64(static_cast<int64_t>(*constArgs[i]));
+        } else if (constArgs[i]) {
+            val = ConstantFP::get(numberTy(), *constArgs[i]);
+        } else {
+            dynArg->setName(argName);
+            val = &*dynArg++;
+        }
+        bindVariable(argName, val);
+        params.emplace_back(namedValues[argName], constArgs[i] ? val : nullptr);
+    }
+    // Calls to the clone itself are those with the same constants.
+    beginTailContext(f, *body, p.getName(), std::move(params));
+    Value* retval = body->codegen();
+    if (retval) {
+        builder->CreateRet(toNumber(retval));
+        endTailContext();
+    }
+    namedValues = std::move(callerValues);
+    tailContext = std::move(callerTail);
+    if (!retval) {
+        f->eraseFromParent();
+        return nullptr;
+    }
+    verifyFunction(*f);
+    fpm->run(*f, *fam);
+    return f;
+}
+
+Function* AST::codegenBatchKernel(const std::string &name) {
+    auto pi = functionProtos.find(name);
+    if (pi == functionProtos.end()) {
+        fprintf(stderr, "Error: Unknown function %s\n", name.c_str());
+        return nullptr;
+    }
+    size_t arity = pi->second->getArgs().size();
+    auto* doubleTy = Type::getDoubleTy(*ctx);
+    auto* doublePtrTy = doubleTy->getPointerTo();
+    auto* i64 = Type::getInt64Ty(*ctx);
+    auto* ft = FunctionType::get(Type::getVoidTy(*ctx), {doublePtrTy, doublePtrTy, i64}, false);
+    Function* kernel = Function::Create(ft, Function::ExternalLinkage, name + ".batch", module.get());
+    auto* in = kernel->getArg(0);
+    auto* out = kernel->getArg(1);
+    auto* rows = kernel->getArg(2);
+    in->setName("in");
+    out->setName("out");
+    rows->setName("rows");
+    kernel->addParamAttr(0, Attribute::NoAlias);
+    kernel->addParamAttr(0, Attribute::ReadOnly);
+    kernel->addParamAttr(1, Attribute::NoAlias);
+
+    // Call a clone of the definition that is inlined below, so the loop over
+    // the rows is optimized, and vectorized, together with the body. Memoized
+    // calls must reach their table and externs have no body to clone.
+    specializeBudgetLeft = specializeBudget;
+    specializedCallees.clear();
+    namedValues.clear();
+    ssa.clear();
+    Function* callee = nullptr;
+    auto di = definitions.find(name);
+    if (di != definitions.end() && !debugInfo && !getMemoSize(name))
+        callee = di->second->codegenSpecialization(std::vector<std::optional<double>>(arity));
+    if (!callee)
+        callee = getFunction(name);
+    if (!callee) {
+        kernel->eraseFromParent();
+        return nullptr;
+    }
+
+    auto* entryBB = BasicBlock::Create(*ctx, "entry", kernel);
+    auto* loopBB = BasicBlock::Create(*ctx, "loop", kernel);
+    auto* exitBB = BasicBlock::Create(*ctx, "exit", kernel);
+    builder->SetInsertPoint(entryBB);
+    builder->CreateCondBr(builder->CreateICmpEQ(rows, builder->getInt64(0)), exitBB, loopBB);
+    builder->SetInsertPoint(loopBB);
+    auto* row = builder->CreatePHI(i64, 2, "row");
+    row->addIncoming(builder->getInt64(0), entryBB);
+    auto* base = builder->CreateMul(row, builder->getInt64(arity), "base", true, true);
+    std::vector<Value*> argsV;
+    for (size_t i = 0; i < arity; i++) {
+        auto* idx = builder->CreateAdd(base, builder->getInt64(i), "idx", true, true);
+        auto* arg = builder->CreateLoad(doubleTy, builder->CreateInBoundsGEP(doubleTy, in, idx), "arg");
+        argsV.push_back(builder->CreateFPCast(arg, callee->getArg(i)->getType()));
+    }
+    auto* call = builder->CreateCall(callee, argsV, "result");
+    builder->CreateStore(builder->CreateFPCast(call, doubleTy), builder->CreateInBoundsGEP(doubleTy, out, row));
+    auto* next = builder->CreateAdd(row, builder->getInt64(1), "row.next", true, true);
+    row->addIncoming(next, loopBB);
+    auto* latch = builder->CreateCondBr(builder->CreateICmpNE(next, rows, "loopcond"), loopBB, exitBB);
+    latch->setMetadata(LLVMContext::MD_loop, mustProgressLoopID());
+    builder->SetInsertPoint(exitBB);
+    builder->CreateRetVoid();
+
+    if (callee->hasInternalLinkage()) {
+        InlineFunctionInfo ifi;
+        InlineFunction(*call, ifi);
+        if (callee->use_empty())
+            callee->eraseFromParent();
+    }
+    verifyFunction(*kernel);
+    fpm->run(*kernel, *fam);
+    return kernel;
+}
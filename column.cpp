@@ -0,0 +1,94 @@
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <sys/mman.h>
+#include <llvm/Support/FileSystem.h>
+#include "column.hpp"
+
+using namespace llvm;
+
+namespace {
+    /// What empty columns point at.
+    const double emptyColumn = NAN;
+
+    struct MappedColumn {
+        std::string path;
+        std::unique_ptr<sys::fs::mapped_file_region> region;
+    };
+
+    std::vector<MappedColumn> mappedColumns;
+}
+
+Column kaleidoscope_columns[maxColumns] = {};
+
+static const bool columnsInitialized = [] {
+    for (auto &c: kaleidoscope_columns)
+        c = {&emptyColumn, 0};
+    return true;
+}();
+
+int openColumn(const std::string &path) {
+    if (mappedColumns.size() == maxColumns) {
+        fprintf(stderr, "Error: At most %u columns can be open\n", maxColumns);
+        return -1;
+    }
+    auto fd = sys::fs::openNativeFileForRead(path);
+    if (!fd) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path.c_str(), toString(fd.takeError()).c_str());
+        return -1;
+    }
+    sys::fs::file_status status;
+    std::error_code ec = sys::fs::status(*fd, status);
+    uint64_t size = ec ? 0 : status.getSize();
+    if (size % sizeof(double))
+        fprintf(stderr, "Warning: %s is not a whole number of doubles, ignoring the last %llu bytes\n", path.c_str(),
+                static_cast<unsigned long long>(size % sizeof(double)));
+    size -= size % sizeof(double);
+    std::unique_ptr<sys::fs::mapped_file_region> region;
+    if (!ec && size) {
+        region = std::make_unique<sys::fs::mapped_file_region>(*fd, sys::fs::mapped_file_region::readonly, size, 0,
+                                                               ec);
+    }
+    sys::fs::closeFile(*fd);
+    if (ec) {
+        fprintf(stderr, "Error: Cannot map %s: %s\n", path.c_str(), ec.message().c_str());
+        return -1;
+    }
+
+    int id = static_cast<int>(mappedColumns.size());
+    auto &c = kaleidoscope_columns[id];
+    if (region) {
+        // Scans are the expected access pattern: read ahead aggressively and
+        // drop pages behind the scan first under memory pressure.
+        madvise(const_cast<char*>(region->const_data()), size, MADV_SEQUENTIAL);
+        c = {reinterpret_cast<const double*>(region->const_data()), size / sizeof(double)};
+    }
+    mappedColumns.push_back({path, std::move(region)});
+    return id;
+}
+
+void printColumns(raw_ostream &os) {
+    for (size_t id = 0; id < mappedColumns.size(); id++)
+        os << "column " << id << ": " << mappedColumns[id].path << ", " << kaleidoscope_columns[id].length
+           << " values\n";
+}
+
+static const Column* findColumn(double id) {
+    id = std::trunc(id);
+    if (!(id >= 0 && id < maxColumns))
+        return nullptr;
+    return &kaleidoscope_columns[static_cast<size_t>(id)];
+}
+
+extern "C" double column(double id, double i) {
+    auto* c = findColumn(id);
+    i = std::trunc(i);
+    if (!c || !(i >= 0 && i < c->length))
+        return NAN;
+    return c->base[static_cast<uint64_t>(i)];
+}
+
+extern "C" double columnLength(double id) {
+    auto* c = findColumn(id);
+    return c ? static_cast<double>(c->length) : 0;
+}
@@ -0,0 +1,33 @@
+#ifndef COLUMN_HPP
+#define COLUMN_HPP
+
+#include <cstdint>
+#include <string>
+#include <llvm/Support/raw_ostream.h>
+
+/// Column - a file of native doubles mapped read-only into memory. Compiled
+/// code reads columns straight from kaleidoscope_columns, see columnAccess in
+/// codegen.cpp; slots that were never opened are empty columns whose base
+/// still points at a readable double, so clamped loads from them are safe.
+struct Column {
+    const double* base;
+    uint64_t length;
+};
+
+constexpr unsigned maxColumns = 256;
+
+/// Map path as the next column, reporting errors to stderr. Returns its id, or -1.
+int openColumn(const std::string &path);
+
+void printColumns(llvm::raw_ostream &os);
+
+extern "C" Column kaleidoscope_columns[maxColumns];
+
+/// Built-in externs, resolved in the host process: element i of column id and
+/// its number of elements. Arguments are truncated to integers; an id naming
+/// no column is an empty column, and elements out of range are NaN. Calls to
+/// them are lowered to loads by codegen.
+extern "C" double column(double id, double i);
+extern "C" double columnLength(double id);
+
+#endif //COLUMN_HPP
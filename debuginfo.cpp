@@ -0,0 +1,45 @@
+#include <llvm/ADT/Triple.h>
+#include <llvm/BinaryFormat/Dwarf.h>
+#include <llvm/IR/Module.h>
+#include "debuginfo.hpp"
+
+using namespace llvm;
+
+DebugInfo::DebugInfo(Module &module) : dbuilder(std::make_unique<DIBuilder>(module)) {
+    module.addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    if (Triple(module.getTargetTriple()).isOSDarwin())
+        module.addModuleFlag(Module::Warning, "Dwarf Version", 2);
+    file = dbuilder->createFile("<stdin>", ".");
+    cu = dbuilder->createCompileUnit(dwarf::DW_LANG_C, file, "Kaleidoscope Compiler", true, "", 0);
+    doubleTy = dbuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+    floatTy = dbuilder->createBasicType("float", 32, dwarf::DW_ATE_float);
+}
+
+void DebugInfo::beginFunction(Function &func, const AST::PrototypeAST &proto, IRBuilder<> &builder) {
+    SmallVector<Metadata*, 8> eltTys{typeOf(func.getReturnType())};
+    for (auto &arg: func.args())
+        eltTys.push_back(typeOf(arg.getType()));
+    auto* fnTy = dbuilder->createSubroutineType(dbuilder->getOrCreateTypeArray(eltTys));
+    unsigned line = proto.getLine();
+    scope = dbuilder->createFunction(file, proto.getName(), StringRef(), file, line, fnTy, line,
+                                     DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    func.setSubprogram(scope);
+    // The prologue has no source location.
+    builder.SetCurrentDebugLocation(DebugLoc());
+}
+
+void DebugInfo::declareParam(Argument &arg, unsigned argNo, int line, IRBuilder<> &builder) {
+    auto* var = dbuilder->createParameterVariable(scope, arg.getName(), argNo, file, line, typeOf(arg.getType()), true);
+    dbuilder->insertDbgValueIntrinsic(&arg, var, dbuilder->createExpression(),
+                                      DILocation::get(scope->getContext(), line, 0, scope), builder.GetInsertBlock());
+}
+
+void DebugInfo::emitLocation(const AST::ExprAST* expr, IRBuilder<> &builder) {
+    if (!expr)
+        return builder.SetCurrentDebugLocation(DebugLoc());
+    builder.SetCurrentDebugLocation(DILocation::get(scope->getContext(), expr->getLine(), expr->getCol(), scope));
+}
+
+void DebugInfo::finalize() {
+    dbuilder->finalize();
+}
@@ -0,0 +1,39 @@
+#ifndef DEBUGINFO_HPP
+#define DEBUGINFO_HPP
+
+#include <memory>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/IRBuilder.h>
+#include "ast.hpp"
+
+/// DebugInfo - emits DWARF line tables and subprograms for one module, so that
+/// perf and gdb can map jitted code back to Kaleidoscope source lines.
+class DebugInfo {
+    std::unique_ptr<llvm::DIBuilder> dbuilder;
+    llvm::DICompileUnit* cu;
+    llvm::DIFile* file;
+    llvm::DIType* doubleTy;
+    llvm::DIType* floatTy;
+    llvm::DISubprogram* scope = nullptr;
+
+    /// The debug type of a value of the floating-point type type.
+    llvm::DIType* typeOf(llvm::Type* type) const { return type->isFloatTy() ? floatTy : doubleTy; }
+
+public:
+    explicit DebugInfo(llvm::Module &module);
+
+    /// Attach a subprogram to func, making it the scope for subsequent locations.
+    void beginFunction(llvm::Function &func, const AST::PrototypeAST &proto, llvm::IRBuilder<> &builder);
+
+    /// Describe a parameter by its SSA value, as codegen keeps no stack slots.
+    void declareParam(llvm::Argument &arg, unsigned argNo, int line, llvm::IRBuilder<> &builder);
+
+    void emitLocation(const AST::ExprAST* expr, llvm::IRBuilder<> &builder);
+
+    void finalize();
+};
+
+/// Set when --perf or --gdb is given; recreated alongside every module.
+extern std::unique_ptr<DebugInfo> debugInfo;
+
+#endif //DEBUGINFO_HPP
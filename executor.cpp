@@ -0,0 +1,197 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "executor.hpp"
+
+/// Close everything an executor inherited except its socket and the standard
+/// streams, so e.g. a client connection the compiler closes is not held open.
+static void closeInheritedDescriptors(int keep) {
+    std::vector<int> fds;
+    if (DIR* dir = opendir("/proc/self/fd")) {
+        while (auto* entry = readdir(dir)) {
+            int fd = atoi(entry->d_name);
+            if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir))
+                fds.push_back(fd);
+        }
+        closedir(dir);
+    }
+    for (int fd: fds)
+        close(fd);
+}
+
+ExecutorPool::ExecutorPool(unsigned processes, std::function<uint64_t()> generation, std::function<void()> setup)
+        : executors(processes), generation(std::move(generation)), setup(std::move(setup)) {}
+
+ExecutorPool::~ExecutorPool() {
+    for (auto &e: executors)
+        stop(e);
+}
+
+void ExecutorPool::start(uint64_t tag, double (*fn)()) {
+    pending.emplace_back(tag, fn);
+    dispatch();
+}
+
+std::vector<ExecutorPool::Result> ExecutorPool::collect() {
+    for (auto &e: executors) {
+        if (!e.tag)
+            continue;
+        double result;
+        ssize_t n = recv(e.fd, &result, sizeof(result), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            continue;
+        if (n == sizeof(result)) {
+            finished.push_back({*e.tag, result});
+            e.tag.reset();
+            continue;
+        }
+        finished.push_back({*e.tag, std::nullopt});
+        close(e.fd);
+        int status = 0;
+        while (waitpid(e.pid, &status, 0) < 0 && errno == EINTR) {}
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "Error: Executor %d was killed by signal %d (%s)\n", e.pid, WTERMSIG(status),
+                    strsignal(WTERMSIG(status)));
+        else
+            fprintf(stderr, "Error: Executor %d exited with status %d\n", e.pid, WEXITSTATUS(status));
+        e = {};
+    }
+    dispatch();
+    return std::exchange(finished, {});
+}
+
+std::vector<int> ExecutorPool::descriptors() const {
+    std::vector<int> fds;
+    for (auto &e: executors)
+        if (e.tag)
+            fds.push_back(e.fd);
+    return fds;
+}
+
+std::optional<double> ExecutorPool::run(double (*fn)()) {
+    start(0, fn);
+    while (true) {
+        if (auto results = collect(); !results.empty())
+            return results.front().value;
+        std::vector<pollfd> fds;
+        for (int fd: descriptors())
+            fds.push_back({fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+            return std::nullopt;
+        }
+    }
+}
+
+void ExecutorPool::dispatch() {
+    auto current = currentGeneration();
+    while (!pending.empty()) {
+        // Prefer an executor that is up to date over forking a stale one.
+        Executor* idle = nullptr;
+        for (auto &e: executors) {
+            if (e.tag)
+                continue;
+            if (e.pid >= 0 && e.generation == current) {
+                idle = &e;
+                break;
+            }
+            if (!idle)
+                idle = &e;
+        }
+        if (!idle)
+            return;
+        auto [tag, fn] = pending.front();
+        pending.pop_front();
+        if (send(*idle, fn))
+            idle->tag = tag;
+        else
+            finished.push_back({tag, std::nullopt});
+    }
+}
+
+bool ExecutorPool::send(Executor &e, double (*fn)()) {
+    auto addr = reinterpret_cast<uint64_t>(fn);
+    // Keep what the compiler printed ahead of what the expression prints; an
+    // executor forked with output still buffered would also write it again.
+    fflush(nullptr);
+    // An idle executor may have died since its last evaluation; fork it again once.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if ((e.pid < 0 || e.generation != currentGeneration()) && !spawn(e))
+            return false;
+        ssize_t n;
+        do
+            n = ::send(e.fd, &addr, sizeof(addr), MSG_NOSIGNAL);
+        while (n < 0 && errno == EINTR);
+        if (n == sizeof(addr))
+            return true;
+        stop(e);
+    }
+    return false;
+}
+
+bool ExecutorPool::spawn(Executor &e) {
+    stop(e);
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "Error: Cannot start executor: %s\n", strerror(errno));
+        return false;
+    }
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error: Cannot start executor: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        serve(sv[1], parent);
+    }
+    close(sv[1]);
+    e.pid = pid;
+    e.fd = sv[0];
+    e.generation = currentGeneration();
+    e.tag.reset();
+    return true;
+}
+
+void ExecutorPool::stop(Executor &e) {
+    if (e.fd >= 0)
+        close(e.fd);
+    if (e.pid > 0) {
+        kill(e.pid, SIGKILL);
+        while (waitpid(e.pid, nullptr, 0) < 0 && errno == EINTR) {}
+    }
+    e = {};
+}
+
+void ExecutorPool::serve(int fd, pid_t parent) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent)
+        _exit(0);
+    closeInheritedDescriptors(fd);
+    setup();
+    while (true) {
+        uint64_t addr;
+        ssize_t n = recv(fd, &addr, sizeof(addr), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != sizeof(addr))
+            _exit(0);
+        double result = reinterpret_cast<double (*)()>(addr)();
+        // What the expression printed must come out before the compiler reports its result.
+        fflush(nullptr);
+        if (::send(fd, &result, sizeof(result), MSG_NOSIGNAL) != sizeof(result))
+            _exit(0);
+    }
+}
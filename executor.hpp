@@ -0,0 +1,82 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <sys/types.h>
+#include <vector>
+
+/// ExecutorPool - runs compiled expressions in worker processes forked from
+/// the compiler, each talking to it over a socket pair. Jitted sections live
+/// in slabs mapped shared (SlabAllocator::Options::Shared), so code linked
+/// once by the compiler is callable at the same address in every executor,
+/// including executors forked before it was linked. Everything else jitted
+/// code depends on (stubs, host memory such as memo tables and columns) is
+/// only copied at fork time: an executor forked before the generation last
+/// changed is forked anew before it runs anything else.
+///
+/// An executor that crashes takes only the evaluation it was running with it.
+/// Forks happen on the calling thread; the pool is not thread-safe.
+class ExecutorPool {
+public:
+    struct Result {
+        uint64_t tag;
+        /// None if the executor died running it.
+        std::optional<double> value;
+    };
+
+    /// generation() changes whenever executors need to be forked again;
+    /// setup() runs in every new executor before its first evaluation.
+    ExecutorPool(unsigned processes, std::function<uint64_t()> generation, std::function<void()> setup);
+
+    ~ExecutorPool();
+
+    ExecutorPool(const ExecutorPool &) = delete;
+    ExecutorPool &operator=(const ExecutorPool &) = delete;
+
+    /// Queue fn to run on the next idle executor; its result is reported by collect under tag.
+    void start(uint64_t tag, double (*fn)());
+
+    /// Results of the evaluations finished since the last call, without blocking.
+    std::vector<Result> collect();
+
+    /// Whether collect has results without waiting for an executor.
+    [[nodiscard]] bool hasFinished() const { return !finished.empty(); }
+
+    /// Sockets of busy executors, readable once their evaluation is done.
+    [[nodiscard]] std::vector<int> descriptors() const;
+
+    /// Run fn and wait for its result. Only for callers that do not use start.
+    std::optional<double> run(double (*fn)());
+
+    /// Host state jitted code reads has changed outside of what generation()
+    /// tracks; fork every executor again before it is next used.
+    void invalidate() { invalidations++; }
+
+private:
+    struct Executor {
+        pid_t pid = -1;
+        int fd = -1;
+        uint64_t generation = 0;
+        std::optional<uint64_t> tag;
+    };
+
+    uint64_t currentGeneration() const { return generation() + invalidations; }
+
+    void dispatch();
+    bool send(Executor &e, double (*fn)());
+    bool spawn(Executor &e);
+    void stop(Executor &e);
+    [[noreturn]] void serve(int fd, pid_t parent);
+
+    std::vector<Executor> executors;
+    std::function<uint64_t()> generation;
+    std::function<void()> setup;
+    uint64_t invalidations = 0;
+    std::deque<std::pair<uint64_t, double (*)()>> pending;
+    std::vector<Result> finished;
+};
+
+#endif //EXECUTOR_HPP
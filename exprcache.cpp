@@ -0,0 +1,74 @@
+#include <llvm/Support/Format.h>
+#include "exprcache.hpp"
+#include "registry.hpp"
+
+using namespace llvm;
+
+FoldingSetNodeID ExprCache::makeKey(const AST::ExprAST &expr, const std::set<std::string> &deps) {
+    FoldingSetNodeID id;
+    expr.profile(id);
+    for (auto &name: deps) {
+        id.AddString(name);
+        auto it = functionInfos.find(name);
+        id.AddInteger(it != functionInfos.end() ? it->second.version : 0);
+    }
+    return id;
+}
+
+const ExprCache::Entry* ExprCache::lookup(const FoldingSetNodeID &id) {
+    void* insertPos;
+    auto* entry = index.FindNodeOrInsertPos(id, insertPos);
+    if (!entry) {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    if (entry->result)
+        resultHits++;
+    entries.splice(entries.begin(), entries, entry->self);
+    return entry;
+}
+
+void ExprCache::insert(const FoldingSetNodeID &id, orc::VModuleKey key, double (*fn)(), std::optional<double> result,
+                       std::set<std::string> deps) {
+    // Another evaluation of the same expression got here first.
+    if (void* insertPos; index.FindNodeOrInsertPos(id, insertPos)) {
+        release(key);
+        return;
+    }
+    if (entries.size() >= capacity) {
+        evictions++;
+        erase(entries.back());
+    }
+    auto &entry = entries.emplace_front();
+    entry.id = id;
+    entry.key = key;
+    entry.fn = fn;
+    entry.result = result;
+    entry.deps = std::move(deps);
+    entry.self = entries.begin();
+    index.InsertNode(&entry);
+}
+
+void ExprCache::invalidate(const std::string &name) {
+    for (auto it = entries.begin(); it != entries.end();) {
+        auto &entry = *it++;
+        if (entry.deps.count(name)) {
+            invalidations++;
+            erase(entry);
+        }
+    }
+}
+
+void ExprCache::erase(Entry &entry) {
+    index.RemoveNode(&entry);
+    release(entry.key);
+    entries.erase(entry.self);
+}
+
+void ExprCache::printStats(raw_ostream &os) const {
+    size_t lookups = hits + misses;
+    os << "expression cache: " << entries.size() << "/" << capacity << " entries, " << hits << "/" << lookups
+       << " hits (" << format("%.1f", lookups ? 100.0 * hits / lookups : 0.0) << "%), " << resultHits
+       << " reused results, " << invalidations << " invalidated, " << evictions << " evicted\n";
+}
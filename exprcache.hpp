@@ -0,0 +1,62 @@
+#ifndef EXPRCACHE_HPP
+#define EXPRCACHE_HPP
+
+#include <functional>
+#include <list>
+#include <optional>
+#include <set>
+#include <string>
+#include <llvm/ADT/FoldingSet.h>
+#include <llvm/Support/raw_ostream.h>
+#include "ast.hpp"
+#include "KaleidoscopeJIT.h"
+
+/// ExprCache - compiled top-level expressions keyed by the structure of their AST
+/// and the versions of every function they may call, so repeating an expression
+/// skips codegen and JIT compilation. Expressions that only call Kaleidoscope
+/// definitions have no side effects; their result is reused without running them.
+class ExprCache {
+public:
+    struct Entry : public llvm::FoldingSetNode {
+        llvm::FoldingSetNodeID id;
+        llvm::orc::VModuleKey key;
+        double (*fn)();
+        std::optional<double> result;
+        std::set<std::string> deps;
+        std::list<Entry>::iterator self;
+
+        void Profile(llvm::FoldingSetNodeID &ID) const { ID = id; }
+    };
+
+    ExprCache(size_t capacity, std::function<void(llvm::orc::VModuleKey)> release)
+            : capacity(capacity), release(std::move(release)) {}
+
+    [[nodiscard]] bool enabled() const { return capacity > 0; }
+
+    static llvm::FoldingSetNodeID makeKey(const AST::ExprAST &expr, const std::set<std::string> &deps);
+
+    /// The entry for id, or nullptr on a miss.
+    const Entry* lookup(const llvm::FoldingSetNodeID &id);
+
+    /// Take ownership of the module key; it is released right away if id is
+    /// already cached.
+    void insert(const llvm::FoldingSetNodeID &id, llvm::orc::VModuleKey key, double (*fn)(),
+                std::optional<double> result, std::set<std::string> deps);
+
+    /// Drop every entry that may call name, which has just been redefined.
+    void invalidate(const std::string &name);
+
+    void printStats(llvm::raw_ostream &os) const;
+
+private:
+    void erase(Entry &entry);
+
+    size_t capacity;
+    std::function<void(llvm::orc::VModuleKey)> release;
+    /// Most recently used first.
+    std::list<Entry> entries;
+    llvm::FoldingSet<Entry> index;
+    size_t hits = 0, resultHits = 0, misses = 0, invalidations = 0, evictions = 0;
+};
+
+#endif //EXPRCACHE_HPP
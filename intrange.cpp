@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cmath>
+#include <llvm/Support/MathExtras.h>
+#include "intrange.hpp"
+
+using namespace AST;
+
+namespace {
+    /// Rounds over the body in which variable ranges may still grow; a
+    /// variable whose range changes in a later round is given up on.
+    constexpr unsigned widenRounds = 3;
+
+    std::optional<IntRange> join(std::optional<IntRange> a, std::optional<IntRange> b) {
+        if (!a || !b)
+            return std::nullopt;
+        return IntRange{std::min(a->lo, b->lo), std::max(a->hi, b->hi)};
+    }
+}
+
+std::optional<IntRange> IntInference::checked(int64_t lo, int64_t hi) const {
+    if (lo < -maxExact || hi > maxExact)
+        return std::nullopt;
+    return IntRange{lo, hi};
+}
+
+std::optional<IntRange> IntInference::constant(double val) const {
+    if (val != std::trunc(val) || std::fabs(val) > static_cast<double>(maxExact) || (val == 0 && std::signbit(val)))
+        return std::nullopt;
+    auto i = static_cast<int64_t>(val);
+    return IntRange{i, i};
+}
+
+/// Operands are within ±maxExact, so sums and differences cannot overflow.
+std::optional<IntRange> IntInference::arith(char op, std::optional<IntRange> l, std::optional<IntRange> r) const {
+    if (!l || !r)
+        return std::nullopt;
+    switch (op) {
+        case '+':
+            return checked(l->lo + r->lo, l->hi + r->hi);
+        case '-':
+            return checked(l->lo - r->hi, l->hi - r->lo);
+        case '*': {
+            // Zero times a negative number is -0.0.
+            auto hasZero = [](const IntRange &x) { return x.lo <= 0 && x.hi >= 0; };
+            if ((hasZero(*l) && r->lo < 0) || (hasZero(*r) && l->lo < 0))
+                return std::nullopt;
+            int64_t lo = INT64_MAX, hi = INT64_MIN;
+            for (int64_t a: {l->lo, l->hi}) {
+                for (int64_t b: {r->lo, r->hi}) {
+                    int64_t p;
+                    if (llvm::MulOverflow(a, b, p))
+                        return std::nullopt;
+                    lo = std::min(lo, p);
+                    hi = std::max(hi, p);
+                }
+            }
+            return checked(lo, hi);
+        }
+        default:
+            return std::nullopt;
+    }
+}
+
+IntInference::IntInference(const ExprAST &body, const std::vector<std::string> &params,
+                           const std::vector<std::optional<double>> &constParams, unsigned digits)
+        : maxExact(int64_t(1) << digits) {
+    for (unsigned i = 0; i < params.size(); i++) {
+        auto id = bind(nullptr, i, params[i]);
+        write(id, i < constParams.size() && constParams[i] ? constant(*constParams[i]) : std::nullopt);
+    }
+    auto paramScope = scope;
+    // Until no variable's range changes. Every variable is written in the first
+    // round and ranges only grow until widenRounds, so this ends.
+    do {
+        changed = false;
+        scope = paramScope;
+        visit(body);
+        round++;
+    } while (changed);
+}
+
+std::optional<IntRange> IntInference::of(const ExprAST &expr) const {
+    auto it = ranges.find(&expr);
+    return it != ranges.end() ? it->second : std::nullopt;
+}
+
+std::optional<IntRange> IntInference::ofBinding(const ExprAST &binder, unsigned index) const {
+    auto it = bindingIds.find({&binder, index});
+    return it != bindingIds.end() ? bindings[it->second].range : std::nullopt;
+}
+
+std::optional<IntRange> IntInference::ofParam(unsigned index) const {
+    auto it = bindingIds.find({nullptr, index});
+    return it != bindingIds.end() ? bindings[it->second].range : std::nullopt;
+}
+
+void IntInference::write(unsigned binding, std::optional<IntRange> val) {
+    auto &b = bindings[binding];
+    auto joined = b.written ? join(b.range, val) : val;
+    if (b.written && joined == b.range)
+        return;
+    b.written = true;
+    b.range = round < widenRounds ? joined : std::nullopt;
+    changed = true;
+}
+
+unsigned IntInference::bind(const ExprAST* binder, unsigned index, const std::string &name) {
+    auto [it, inserted] = bindingIds.try_emplace({binder, index}, bindings.size());
+    if (inserted)
+        bindings.emplace_back();
+    scope.emplace_back(name, it->second);
+    return it->second;
+}
+
+std::optional<IntRange> IntInference::visit(const ExprAST &expr) {
+    auto range = visitNode(expr);
+    ranges[&expr] = range;
+    return range;
+}
+
+std::optional<IntRange> IntInference::visitNode(const ExprAST &expr) {
+    auto lookup = [&](const std::string &name) -> std::optional<unsigned> {
+        for (auto it = scope.rbegin(); it != scope.rend(); ++it)
+            if (it->first == name)
+                return it->second;
+        return std::nullopt;
+    };
+
+    if (auto* num = dynamic_cast<const NumberExprAST*>(&expr))
+        return constant(num->getVal());
+    if (auto* var = dynamic_cast<const VariableExprAST*>(&expr)) {
+        auto id = lookup(var->getName());
+        return id ? bindings[*id].range : std::nullopt;
+    }
+    if (auto* bin = dynamic_cast<const BinaryExprAST*>(&expr)) {
+        if (bin->getOp() == '=') {
+            auto val = visit(bin->getRHS());
+            if (auto* dest = dynamic_cast<const VariableExprAST*>(&bin->getLHS()))
+                if (auto id = lookup(dest->getName()))
+                    write(*id, val);
+            return val;
+        }
+        auto l = visit(bin->getLHS());
+        auto r = visit(bin->getRHS());
+        if (bin->getOp() == '<')
+            return IntRange{0, 1};
+        return arith(bin->getOp(), l, r);
+    }
+    if (auto* ifExpr = dynamic_cast<const IfExprAST*>(&expr)) {
+        visit(ifExpr->getCond());
+        auto then = visit(ifExpr->getThen());
+        return join(then, visit(ifExpr->getElse()));
+    }
+    if (auto* varExpr = dynamic_cast<const VarExprAST*>(&expr)) {
+        auto depth = scope.size();
+        auto &vars = varExpr->getVars();
+        for (unsigned i = 0; i < vars.size(); i++) {
+            auto &[name, init] = vars[i];
+            auto val = init ? visit(*init) : IntRange{0, 0};
+            write(bind(varExpr, i, name), val);
+        }
+        auto val = visit(varExpr->getBody());
+        scope.resize(depth);
+        return val;
+    }
+    if (auto* loop = dynamic_cast<const ForExprAST*>(&expr)) {
+        auto start = visit(loop->getStart());
+        std::optional<IntRange> step = IntRange{1, 1};
+        if (loop->isCounted()) {
+            // The body runs with every a + k*s below the bound n, then once
+            // more with the first one that is not.
+            if (loop->getStep())
+                step = visit(*loop->getStep());
+            auto n = visit(static_cast<const BinaryExprAST &>(loop->getEnd()).getRHS());
+            auto id = bind(loop, 0, loop->getVarName());
+            write(id, start && step && n ? checked(start->lo, std::max(start->hi, n->hi - 1 + step->hi))
+                                         : std::nullopt);
+            visit(loop->getBody());
+        } else {
+            auto id = bind(loop, 0, loop->getVarName());
+            write(id, start);
+            visit(loop->getBody());
+            if (loop->getStep())
+                step = visit(*loop->getStep());
+            write(id, arith('+', bindings[id].range, step));
+            visit(loop->getEnd());
+        }
+        scope.pop_back();
+        if (loop->getReduction() == ForExprAST::Reduction::None)
+            return IntRange{0, 0};
+        return std::nullopt;
+    }
+    // Calls and user operators return doubles; their operands are still visited.
+    expr.forEachChild([&](const ExprAST &child) { visit(child); });
+    return std::nullopt;
+}
@@ -0,0 +1,78 @@
+#ifndef INTRANGE_HPP
+#define INTRANGE_HPP
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ast.hpp"
+
+/// IntRange - bounds on a value that is always an integer floating-point
+/// arithmetic represents exactly: within ±2^digits of the significand (2^53
+/// for doubles), and never -0.0. Adding, subtracting and multiplying such
+/// values in i64 gives the numbers the source computes, as long as the result
+/// is one as well.
+struct IntRange {
+    int64_t lo, hi;
+
+    bool operator==(const IntRange &other) const { return lo == other.lo && hi == other.hi; }
+};
+
+/// IntInference - which expressions and variables of one function body only
+/// ever hold values with an IntRange. The ranges come from constants,
+/// comparisons and the bounds of counted loops, and flow through the builtin
+/// arithmetic operators, ifs and variables; calls, user operators, parameters
+/// and reductions yield arbitrary doubles. A variable's range covers every
+/// value written to it anywhere, and variables still growing after a few
+/// rounds over the body, like accumulators, are given up on.
+class IntInference {
+public:
+    /// Parameters bound to a constant, as in a specialized clone, have its
+    /// value; the others may hold any number. digits is the precision of the
+    /// numbers the body computes with.
+    IntInference(const AST::ExprAST &body, const std::vector<std::string> &params,
+                 const std::vector<std::optional<double>> &constParams, unsigned digits);
+
+    /// The range of every value expr evaluates to, if there is one.
+    [[nodiscard]] std::optional<IntRange> of(const AST::ExprAST &expr) const;
+
+    /// The range of the variable bound by a var (index is its position) or a for loop.
+    [[nodiscard]] std::optional<IntRange> ofBinding(const AST::ExprAST &binder, unsigned index = 0) const;
+
+    /// The range of a parameter.
+    [[nodiscard]] std::optional<IntRange> ofParam(unsigned index) const;
+
+private:
+    struct Binding {
+        std::optional<IntRange> range;
+        bool written = false;
+    };
+
+    std::optional<IntRange> visit(const AST::ExprAST &expr);
+
+    std::optional<IntRange> visitNode(const AST::ExprAST &expr);
+
+    /// Join val into the binding's range.
+    void write(unsigned binding, std::optional<IntRange> val);
+
+    unsigned bind(const AST::ExprAST* binder, unsigned index, const std::string &name);
+
+    std::optional<IntRange> checked(int64_t lo, int64_t hi) const;
+
+    std::optional<IntRange> constant(double val) const;
+
+    std::optional<IntRange> arith(char op, std::optional<IntRange> l, std::optional<IntRange> r) const;
+
+    std::vector<Binding> bindings;
+    std::map<std::pair<const AST::ExprAST*, unsigned>, unsigned> bindingIds;
+    /// Names in scope at the expression being visited, innermost binding last.
+    std::vector<std::pair<std::string, unsigned>> scope;
+    std::map<const AST::ExprAST*, std::optional<IntRange>> ranges;
+    int64_t maxExact;
+    unsigned round = 0;
+    bool changed = false;
+};
+
+#endif //INTRANGE_HPP
@@ -1,8 +1,10 @@
 #ifndef LEXER_HPP
 #define LEXER_HPP
 
+#include <cstdio>
 #include <string>
 #include <sstream>
+#include "location.hpp"
 
 enum Token {
     EOF_ = -1,
@@ -18,20 +20,52 @@ enum Token {
     BINARY = -11,
     UNARY = -12,
     VAR = -13,
+    COMMAND = -14,
 };
 
 static std::string identStr;
+static std::string commandArg;
 static double numVal;
+static SourceLocation curLoc;
+static SourceLocation lexLoc = {1, 0};
+/// Where the program is read from.
+static FILE* lexInput = stdin;
+/// The last character read was a '\r'.
+static bool afterCR = false;
+
+static int advance() {
+    int c = getc(lexInput);
+    // A '\n' right after a '\r' is the second half of one CRLF line break.
+    if (c == '\r' || (c == '\n' && !afterCR)) {
+        lexLoc.line++;
+        lexLoc.col = 0;
+    } else if (c != '\n') {
+        lexLoc.col++;
+    }
+    afterCR = c == '\r';
+    return c;
+}
+
+/// The character after the last token.
+static int prevChar = ' ';
+
+/// Start lexing a new input from its first line.
+static void resetLexer(FILE* in) {
+    lexInput = in;
+    prevChar = ' ';
+    lexLoc = {1, 0};
+    afterCR = false;
+}
 
 static int gettok() {
-    static int prevChar = ' ';
     while (isspace(prevChar))
-        prevChar = getchar();
+        prevChar = advance();
+    curLoc = lexLoc;
     if (isalpha(prevChar)) {
         std::stringstream ss;
         ss << static_cast<char>(prevChar);
 
-        while (isalnum(prevChar = getchar())) {
+        while (isalnum(prevChar = advance())) {
             ss << static_cast<char>(prevChar);
         }
         ss >> identStr;
@@ -61,14 +95,30 @@ static int gettok() {
         std::stringstream ss;
         do {
             ss << static_cast<char>(prevChar);
-            prevChar = getchar();
+            prevChar = advance();
         } while (isdigit(prevChar) || prevChar == '.');
         ss >> numVal;
         return Token::NUM;
     }
+    // REPL commands: '@' followed by the command name, e.g. "@stats" or "@snapshot file".
+    if (prevChar == '@') {
+        identStr.clear();
+        while (isalnum(prevChar = advance()))
+            identStr += static_cast<char>(prevChar);
+        // The rest of the line is the command's argument.
+        commandArg.clear();
+        while (prevChar != EOF && prevChar != '\n' && prevChar != '\r') {
+            commandArg += static_cast<char>(prevChar);
+            prevChar = advance();
+        }
+        while (!commandArg.empty() && isspace(commandArg.back()))
+            commandArg.pop_back();
+        commandArg.erase(0, commandArg.find_first_not_of(" \t"));
+        return Token::COMMAND;
+    }
     if (prevChar == '#') {
         do {
-            prevChar = getchar();
+            prevChar = advance();
         } while (prevChar != EOF && prevChar != '\n' && prevChar != '\r');
         if (prevChar != EOF)
             return gettok();
@@ -76,7 +126,7 @@ static int gettok() {
     if (prevChar == EOF)
         return Token::EOF_;
     int curChar = prevChar;
-    prevChar = getchar();
+    prevChar = advance();
     return curChar;
 }
 
@@ -0,0 +1,123 @@
+// Load generator for kaleidoscope --serve: closed-loop clients each sending the
+// same request and waiting for its response, reporting throughput and latency.
+//
+//   kaleidoscope --serve=/tmp/k.sock prelude.k &
+//   kaleidoscope-loadgen --socket=/tmp/k.sock --clients=16 --requests=10000 --request='fib(20);'
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <llvm/Support/CommandLine.h>
+#include "protocol.hpp"
+
+using namespace llvm;
+
+static cl::opt<std::string> socketPath("socket", cl::desc("Socket the server listens on"), cl::Required);
+static cl::opt<unsigned> numClients("clients", cl::desc("Concurrent connections"), cl::init(8));
+static cl::opt<unsigned> numRequests("requests", cl::desc("Requests sent by each connection"), cl::init(1000));
+static cl::opt<std::string> setup("setup", cl::desc("Sent once by each connection before it is timed, e.g. its "
+                                                    "own definitions"));
+static cl::opt<std::string> request("request", cl::desc("Kaleidoscope source of every request"), cl::init("1 + 2;"));
+
+namespace {
+    class Connection {
+    public:
+        bool open() {
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+            return fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        }
+
+        ~Connection() {
+            if (fd >= 0)
+                close(fd);
+        }
+
+        /// Send source and wait for its response; false if the connection failed.
+        bool roundTrip(const std::string &source, std::string &response) {
+            std::string out;
+            protocol::appendFrame(out, source);
+            for (size_t done = 0; done < out.size();) {
+                ssize_t n = send(fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                done += n;
+            }
+            while (!protocol::takeFrame(in, response)) {
+                char buf[4096];
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                in.append(buf, n);
+            }
+            return true;
+        }
+
+    private:
+        int fd = -1;
+        std::string in;
+    };
+}
+
+int main(int argc, char** argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope server load generator\n");
+    std::vector<std::vector<double>> latencies(numClients);
+    std::atomic<unsigned> failedClients{0}, errorResponses{0};
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < numClients; i++) {
+        threads.emplace_back([&, i] {
+            Connection conn;
+            std::string response;
+            if (!conn.open() || (!setup.empty() && !conn.roundTrip(setup, response))) {
+                failedClients++;
+                return;
+            }
+            auto &samples = latencies[i];
+            samples.reserve(numRequests);
+            for (unsigned r = 0; r < numRequests; r++) {
+                auto sent = std::chrono::steady_clock::now();
+                if (!conn.roundTrip(request, response)) {
+                    failedClients++;
+                    return;
+                }
+                std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - sent;
+                samples.push_back(elapsed.count());
+                if (response.find("error:") != std::string::npos)
+                    errorResponses++;
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::vector<double> all;
+    for (auto &samples: latencies)
+        all.insert(all.end(), samples.begin(), samples.end());
+    if (all.empty()) {
+        fprintf(stderr, "Error: No request completed; is the server listening on %s?\n", socketPath.c_str());
+        return 1;
+    }
+    std::sort(all.begin(), all.end());
+    auto pct = [&](double p) { return all[static_cast<size_t>(p * (all.size() - 1))]; };
+    printf("%zu requests in %.3fs: %.0f requests/s\n", all.size(), elapsed.count(), all.size() / elapsed.count());
+    printf("latency p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n", pct(0.5), pct(0.99), pct(0.999), all.back());
+    if (failedClients || errorResponses)
+        printf("%u connections failed, %u responses with errors\n", failedClients.load(), errorResponses.load());
+    return failedClients ? 1 : 0;
+}
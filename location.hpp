@@ -0,0 +1,10 @@
+#ifndef LOCATION_HPP
+#define LOCATION_HPP
+
+/// SourceLocation - line and column of a token in the input, used for debug info.
+struct SourceLocation {
+    int line = 0;
+    int col = 0;
+};
+
+#endif //LOCATION_HPP
@@ -1,87 +1,201 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <optional>
 #include <iostream>
-#include "llvm/IR/IRBuilder.h"
-#include <llvm/IR/LegacyPassManager.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/Transforms/Utils.h>
+#include <sstream>
+#include <unistd.h>
+#include <llvm/Support/CommandLine.h>
 
 #include "parser.hpp"
+#include "column.hpp"
+#include "executor.hpp"
+#include "exprcache.hpp"
+#include "memo.hpp"
+#include "registry.hpp"
+#include "reload.hpp"
+#include "server.hpp"
+#include "snapshot.hpp"
+#include "stream.hpp"
 #include "KaleidoscopeJIT.h"
 
 using namespace parser;
 
-std::unique_ptr<LLVMContext> ctx;
-std::unique_ptr<Module> module;
-std::unique_ptr<IRBuilder<>> builder;
-std::unique_ptr<legacy::FunctionPassManager> fpm;
-std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
-std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
-std::map<char, int> binopPrec = {{'=', 2},
-                                 {'<', 10},
-                                 {'+', 20},
-                                 {'-', 30},
-                                 {'*', 40}};;
-
-static void initModuleAndPassMgr() {
-    ctx = std::make_unique<LLVMContext>();
-    module = std::make_unique<Module>("my jit", *ctx);
-    module->setDataLayout(jit->getTargetMachine().createDataLayout());
-
-    fpm = std::make_unique<legacy::FunctionPassManager>(module.get());
-    fpm->add(createPromoteMemoryToRegisterPass());
-    fpm->add(createInstructionCombiningPass());
-    fpm->add(createReassociatePass());
-    fpm->add(createGVNPass());
-    fpm->add(createCFGSimplificationPass());
-    fpm->doInitialization();
-    builder = std::make_unique<IRBuilder<>>(*ctx);
-}
+static cl::opt<bool> memoryStats("jit-memory-stats", cl::desc("Print live code and data bytes per module on exit"));
+static cl::opt<std::string> restorePath("restore", cl::desc("Restore the session saved by @snapshot before reading input"),
+                                        cl::value_desc("file"));
+static cl::opt<bool> latencyReport("latency-report", cl::desc("Print p50/p99 latency per statement kind on exit"));
+static cl::opt<std::string> inputFile(cl::Positional, cl::desc("<program>"), cl::init("-"));
+static cl::opt<std::string> streamFunction("stream", cl::desc("After reading the program, apply this function to each "
+                                                              "record read from stdin and write the results to stdout"),
+                                           cl::value_desc("function"));
+static cl::opt<std::string> servePath("serve", cl::desc("After reading the program, serve evaluation requests on "
+                                                        "a Unix domain socket"), cl::value_desc("path"));
+static cl::opt<unsigned> serveWorkers("serve-workers", cl::desc("Threads running expressions for --serve without "
+                                                                "--executors (default: one per CPU)"), cl::init(0));
+static cl::opt<StreamFormat> streamFormat(
+        "stream-format", cl::desc("Record format of --stream"), cl::init(StreamFormat::Text),
+        cl::values(clEnumValN(StreamFormat::Text, "text", "Comma-separated fields, one record per line"),
+                   clEnumValN(StreamFormat::Binary, "binary", "Native doubles, one per field and result")));
+
+extern std::unique_ptr<Module> module;
+extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
+extern std::unique_ptr<ExprCache> exprCache;
+extern std::unique_ptr<ExecutorPool> executors;
+extern std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+extern std::map<std::string, std::unique_ptr<FunctionAST>> definitions;
+
+void initSession();
+void initModule();
+llvm::orc::VModuleKey addModuleToJIT(bool retain = false);
+void recompile(FunctionAST &fn);
+std::optional<llvm::orc::VModuleKey> addDefinition(std::unique_ptr<FunctionAST> fn, bool print);
+bool addExtern(std::unique_ptr<PrototypeAST> proto, bool print);
+std::optional<double> evaluate(double (*fn)());
 
 static void handleDefn() {
-    if (auto fn = parseDefn()) {
-        if (auto* fnIR = fn->codegen()) {
-            fprintf(stdout, "Read fn defn:\n");
-            fnIR->print(outs());
-            fprintf(stdout, "\n");
-            jit->addModule(std::move(module));
-            initModuleAndPassMgr();
-        }
-    } else {
+    if (auto fn = parseDefn())
+        addDefinition(std::move(fn), true);
+    else
         getNextToken();
-    }
 }
 
 static void handleExtern() {
-    if (auto proto = parseExtern()) {
-        if (auto* fnIR = proto->codegen()) {
-            fprintf(stdout, "Read extern:\n");
-            fnIR->print(outs());
-            fprintf(stdout, "\n");
-            functionProtos[proto->getName()] = std::move(proto);
-        }
-    } else {
+    if (auto proto = parseExtern())
+        addExtern(std::move(proto), true);
+    else
         getNextToken();
-    }
 }
 
 static void handleTopLevelExpr() {
     if (auto fn = parseTopLevelExpr()) {
-        if (fn->codegen()) {
-            auto h = jit->addModule(std::move(module));
-            initModuleAndPassMgr();
-            auto exprSym = jit->findSymbol("__anon_expr");
+        std::set<std::string> deps;
+        FoldingSetNodeID key;
+        if (exprCache->enabled()) {
+            deps = transitiveCallees(collectCallees(fn->getBody()));
+            key = ExprCache::makeKey(fn->getBody(), deps);
+            if (auto* hit = exprCache->lookup(key)) {
+                if (auto result = hit->result ? hit->result : evaluate(hit->fn))
+                    fprintf(stdout, "Evaluated to %f\n", *result);
+                return;
+            }
+        }
+        if (auto* fnIR = fn->codegen()) {
+            functionProtos.erase("__anon_expr");
+            // Cached expressions stay resident, so each needs a symbol of its own.
+            static unsigned cachedExprs = 0;
+            if (exprCache->enabled())
+                fnIR->setName("__anon_expr." + std::to_string(++cachedExprs));
+            auto name = fnIR->getName().str();
+            auto h = addModuleToJIT();
+            initModule();
+            auto exprSym = jit->findSymbol(name);
             assert(exprSym && "Function not found");
 
             auto fp = (double (*)()) (intptr_t) cantFail(exprSym.getAddress());
-            fprintf(stdout, "Evaluated to %f\n", fp());
-            jit->removeModule(h);
+            auto result = evaluate(fp);
+            if (result)
+                fprintf(stdout, "Evaluated to %f\n", *result);
+            if (exprCache->enabled() && result) {
+                bool pure = allReadNone(deps);
+                exprCache->insert(key, h, fp, pure ? result : std::nullopt, std::move(deps));
+            } else {
+                jit->removeModule(h);
+            }
         }
     } else {
         getNextToken();
     }
 }
 
+/// @memo <name> <entries>: memoize a pure function with a table of at most that
+/// many entries (0 turns it off). Without arguments, print hit rates.
+static void handleMemo(const std::string &arg) {
+    std::istringstream in(arg);
+    std::string name;
+    size_t entries;
+    if (!(in >> name)) {
+        printMemoStats(outs());
+        outs().flush();
+        return;
+    }
+    if (!(in >> entries)) {
+        fprintf(stderr, "Error: Usage: @memo <function> <entries>\n");
+        return;
+    }
+    auto fi = functionInfos.find(name);
+    if (entries && fi != functionInfos.end() && !fi->second.readNone) {
+        fprintf(stderr, "Error: %s may have side effects and cannot be memoized\n", name.c_str());
+        return;
+    }
+    setMemoSize(name, entries);
+    auto it = definitions.find(name);
+    if (it != definitions.end())
+        recompile(*it->second);
+}
+
+static void handleCommand() {
+    std::string cmd = identStr;
+    std::string arg = commandArg;
+    getNextToken();
+    if (cmd == "stats") {
+        outs() << "prototypes: " << functionProtos.size() << "\n";
+        jit->printMemoryStats(outs());
+        exprCache->printStats(outs());
+        printMemoStats(outs());
+        printColumns(outs());
+        outs().flush();
+    } else if (cmd == "memo") {
+        handleMemo(arg);
+    } else if (cmd == "column") {
+        if (arg.empty()) {
+            printColumns(outs());
+            outs().flush();
+        } else if (int id = openColumn(arg); id >= 0) {
+            // Executors forked earlier do not have the new mapping.
+            if (executors)
+                executors->invalidate();
+            fprintf(stdout, "column %d: %s, %llu values\n", id, arg.c_str(),
+                    static_cast<unsigned long long>(kaleidoscope_columns[id].length));
+        }
+    } else if (cmd == "reload") {
+        if (arg.empty())
+            fprintf(stderr, "Error: Usage: @reload <file>\n");
+        else
+            reloadFile(arg);
+    } else if (cmd == "snapshot") {
+        if (arg.empty())
+            fprintf(stderr, "Error: Usage: @snapshot <file>\n");
+        else
+            writeSnapshot(arg);
+    } else {
+        fprintf(stderr, "Error: Unknown command @%s\n", cmd.c_str());
+    }
+}
+
+/// Per statement kind wall-clock latencies, in microseconds, for --latency-report.
+static std::map<std::string, std::vector<double>> latencies;
+
+template<typename Handler>
+static void timeStatement(const char* kind, Handler handler) {
+    if (!latencyReport)
+        return handler();
+    auto start = std::chrono::steady_clock::now();
+    handler();
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    latencies[kind].push_back(elapsed.count());
+}
+
+static void printLatencyReport() {
+    for (auto &[kind, samples]: latencies) {
+        std::sort(samples.begin(), samples.end());
+        auto pct = [&](double p) { return samples[static_cast<size_t>(p * (samples.size() - 1))]; };
+        fprintf(stderr, "%-6s n=%-6zu p50=%9.1fus p99=%9.1fus max=%9.1fus\n", kind.c_str(), samples.size(),
+                pct(0.5), pct(0.99), samples.back());
+    }
+}
+
 static void mainLoop() {
     while (true) {
         fprintf(stdout, "ready> ");
@@ -92,42 +206,76 @@ static void mainLoop() {
                 getNextToken();
                 break;
             case Token::DEF:
-                handleDefn();
+                timeStatement("def", handleDefn);
                 break;
             case Token::EXTERN:
-                handleExtern();
+                timeStatement("extern", handleExtern);
+                break;
+            case Token::COMMAND:
+                handleCommand();
                 break;
             default:
-                handleTopLevelExpr();
+                timeStatement("expr", handleTopLevelExpr);
                 break;
         }
     }
 }
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
+/// Compile a batch kernel for streamFunction and run the records on stdin
+/// through it, writing results to outFd.
+static bool runStream(int outFd) {
+    auto* kernel = codegenBatchKernel(streamFunction);
+    if (!kernel)
+        return false;
+    auto name = kernel->getName().str();
+    addModuleToJIT();
+    initModule();
+    auto sym = jit->findSymbol(name);
+    assert(sym && "Function not found");
+    auto fn = (BatchKernel) (intptr_t) cantFail(sym.getAddress());
+    unsigned arity = functionProtos[streamFunction]->getArgs().size();
+    return streamRecords(fn, arity, streamFormat, STDIN_FILENO, outFd);
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
-}
-
-int main() {
+int main(int argc, char** argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+    int streamOut = -1;
+    if (!streamFunction.empty()) {
+        if (inputFile == "-") {
+            fprintf(stderr, "Error: --stream reads records from stdin, the program must be given as a file\n");
+            return 1;
+        }
+        // Results own stdout; the REPL's output goes to stderr instead.
+        streamOut = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    if (inputFile != "-" && !(lexInput = fopen(inputFile.c_str(), "r"))) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", inputFile.c_str(), strerror(errno));
+        return 1;
+    }
     LLVMInitializeNativeTarget();
     LLVMInitializeNativeAsmPrinter();
     LLVMInitializeNativeAsmParser();
     fprintf(stdout, "ready> ");
     getNextToken();
 
-    jit = std::make_unique<llvm::orc::KaleidoscopeJIT>();
-
-    initModuleAndPassMgr();
+    initSession();
+    if (!restorePath.empty() && !restoreSnapshot(restorePath))
+        return 1;
+    initModule();
 
     mainLoop();
+    if (streamOut >= 0) {
+        fflush(stdout);
+        if (!runStream(streamOut))
+            return 1;
+    }
+    if (!servePath.empty() && !runServer(servePath, serveWorkers))
+        return 1;
     module->print(errs(), nullptr);
+    if (memoryStats)
+        jit->printMemoryStats(errs());
+    if (latencyReport)
+        printLatencyReport();
     return 0;
 }
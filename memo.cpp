@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <llvm/ADT/bit.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MathExtras.h>
+#include "memo.hpp"
+#include "KaleidoscopeJIT.h"
+
+using namespace llvm;
+
+extern std::unique_ptr<orc::KaleidoscopeJIT> jit;
+
+MemoTable::MemoTable(unsigned arity, size_t entries)
+        : arity(arity), mask(PowerOf2Floor(std::max<size_t>(entries, 1)) - 1),
+          words(new std::atomic<uint64_t>[(mask + 1) * (2 + arity)]) {
+    for (size_t i = 0; i < (mask + 1) * (2 + arity); i++)
+        words[i].store(0, std::memory_order_relaxed);
+}
+
+std::atomic<uint64_t>* MemoTable::slot(const double* args) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (unsigned i = 0; i < arity; i++) {
+        h ^= bit_cast<uint64_t>(args[i]) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+    }
+    return &words[(h & mask) * (2 + arity)];
+}
+
+bool MemoTable::lookup(const double* args, double &result) {
+    auto* s = slot(args);
+    uint64_t seq = s[0].load(std::memory_order_acquire);
+    // Zero means never written; odd means a writer holds the slot.
+    bool hit = seq != 0 && !(seq & 1);
+    uint64_t value = s[1].load(std::memory_order_relaxed);
+    for (unsigned i = 0; hit && i < arity; i++)
+        hit = s[2 + i].load(std::memory_order_relaxed) == bit_cast<uint64_t>(args[i]);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    hit = hit && s[0].load(std::memory_order_relaxed) == seq;
+    (hit ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+    if (hit)
+        result = bit_cast<double>(value);
+    return hit;
+}
+
+void MemoTable::store(const double* args, double result) {
+    auto* s = slot(args);
+    uint64_t seq = s[0].load(std::memory_order_relaxed);
+    if ((seq & 1) || !s[0].compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+    s[1].store(bit_cast<uint64_t>(result), std::memory_order_relaxed);
+    for (unsigned i = 0; i < arity; i++)
+        s[2 + i].store(bit_cast<uint64_t>(args[i]), std::memory_order_relaxed);
+    s[0].store(seq + 2, std::memory_order_release);
+}
+
+namespace {
+    struct MemoFunction {
+        size_t entries = 0;
+        /// The table of the newest compilation, for statistics.
+        MemoTable* current = nullptr;
+    };
+
+    /// A table created for one compilation of a wrapper.
+    struct LiveTable {
+        std::string name;
+        unsigned arity;
+        std::unique_ptr<MemoTable> table;
+    };
+
+    std::map<std::string, MemoFunction> memoFunctions;
+    std::map<uint64_t, LiveTable> liveTables;
+    uint64_t nextSerial = 0;
+
+    std::string addTable(const std::string &name, uint64_t serial, unsigned arity, size_t entries) {
+        auto &live = liveTables[serial];
+        live = {name, arity, std::make_unique<MemoTable>(arity, entries)};
+        memoFunctions[name].current = live.table.get();
+        nextSerial = std::max(nextSerial, serial + 1);
+        auto symbol = "__memo." + name + "." + std::to_string(serial);
+        jit->addHostSymbol(symbol, live.table.get(), [serial] {
+            auto it = liveTables.find(serial);
+            auto &memo = memoFunctions[it->second.name];
+            if (memo.current == it->second.table.get())
+                memo.current = nullptr;
+            liveTables.erase(it);
+        });
+        jit->addHostSymbol("kaleidoscope_memo_lookup", reinterpret_cast<void*>(&kaleidoscope_memo_lookup));
+        jit->addHostSymbol("kaleidoscope_memo_store", reinterpret_cast<void*>(&kaleidoscope_memo_store));
+        return symbol;
+    }
+}
+
+void setMemoSize(const std::string &name, size_t entries) {
+    memoFunctions[name].entries = entries;
+}
+
+size_t getMemoSize(const std::string &name) {
+    auto it = memoFunctions.find(name);
+    return it != memoFunctions.end() ? it->second.entries : 0;
+}
+
+std::string createMemoTable(const std::string &name, unsigned arity) {
+    return addTable(name, nextSerial, arity, getMemoSize(name));
+}
+
+void restoreMemoTable(const std::string &name, uint64_t serial, unsigned arity, size_t entries) {
+    addTable(name, serial, arity, entries);
+}
+
+void forEachMemoSize(const std::function<void(const std::string &, size_t)> &fn) {
+    for (auto &[name, memo]: memoFunctions)
+        if (memo.entries)
+            fn(name, memo.entries);
+}
+
+void forEachMemoTable(const std::function<void(const std::string &, uint64_t, unsigned, size_t)> &fn) {
+    for (auto &[serial, live]: liveTables)
+        fn(live.name, serial, live.arity, live.table->size());
+}
+
+void printMemoStats(raw_ostream &os) {
+    for (auto &[name, memo]: memoFunctions) {
+        if (!memo.current)
+            continue;
+        auto hits = memo.current->getHits(), lookups = hits + memo.current->getMisses();
+        os << "memo " << name << ": " << memo.current->size() << " entries, " << hits << "/" << lookups
+           << " hits (" << format("%.1f", lookups ? 100.0 * hits / lookups : 0.0) << "%)"
+           << (memo.entries ? "" : ", disabled") << "\n";
+    }
+}
+
+extern "C" bool kaleidoscope_memo_lookup(MemoTable* table, const double* args, double* result) {
+    return table->lookup(args, *result);
+}
+
+extern "C" void kaleidoscope_memo_store(MemoTable* table, const double* args, double result) {
+    table->store(args, result);
+}
@@ -0,0 +1,71 @@
+#ifndef MEMO_HPP
+#define MEMO_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <llvm/Support/raw_ostream.h>
+
+/// MemoTable - a fixed-size, direct-mapped cache of a pure function's results
+/// keyed on the bit patterns of its arguments, shared by every thread calling
+/// the function. Each slot is guarded by a sequence counter: readers treat a
+/// slot being written as a miss and writers skip a slot another writer holds,
+/// so neither blocks nor retries. Keys compare bitwise, so a hit returns
+/// exactly what the function computed for those arguments.
+class MemoTable {
+public:
+    MemoTable(unsigned arity, size_t entries);
+
+    bool lookup(const double* args, double &result);
+
+    void store(const double* args, double result);
+
+    [[nodiscard]] size_t size() const { return mask + 1; }
+
+    [[nodiscard]] uint64_t getHits() const { return hits.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] uint64_t getMisses() const { return misses.load(std::memory_order_relaxed); }
+
+private:
+    /// Slot layout in words: sequence, result, then one word per argument.
+    std::atomic<uint64_t>* slot(const double* args);
+
+    unsigned arity;
+    size_t mask;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    std::atomic<uint64_t> hits{0}, misses{0};
+};
+
+/// Memoize calls to name with a table of up to entries results, the largest
+/// power of two that fits, or stop memoizing it when entries is zero. Takes
+/// effect when name is next compiled.
+void setMemoSize(const std::string &name, size_t entries);
+
+/// The configured table size for name, zero if it is not memoized.
+size_t getMemoSize(const std::string &name);
+
+/// Give a new compilation of name's body an empty table of its own and return
+/// the table's symbol, which the compiled wrapper passes to the entry points.
+/// A table is freed with the last module linked against it, so code of an
+/// earlier compilation that is still running only ever sees its own table.
+std::string createMemoTable(const std::string &name, unsigned arity);
+
+/// Recreate the empty table of a compilation restored from a snapshot under
+/// the serial it was created with.
+void restoreMemoTable(const std::string &name, uint64_t serial, unsigned arity, size_t entries);
+
+/// Call fn for every memoized function and its configured size.
+void forEachMemoSize(const std::function<void(const std::string &, size_t)> &fn);
+
+/// Call fn(name, serial, arity, entries) for every live table, oldest first.
+void forEachMemoTable(const std::function<void(const std::string &, uint64_t, unsigned, size_t)> &fn);
+
+void printMemoStats(llvm::raw_ostream &os);
+
+/// Entry points called by memoized wrappers.
+extern "C" bool kaleidoscope_memo_lookup(MemoTable* table, const double* args, double* result);
+extern "C" void kaleidoscope_memo_store(MemoTable* table, const double* args, double result);
+
+#endif //MEMO_HPP
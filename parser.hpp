@@ -1,11 +1,18 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
 
+#include <algorithm>
+#include <climits>
+#include <functional>
 #include <map>
+#include <string>
+#include <utility>
+#include <vector>
 #include "lexer.hpp"
 #include "ast.hpp"
+#include "binop.hpp"
 
-extern std::map<char, int> binopPrec;
+extern BinopTable binops;
 
 namespace parser {
     using namespace AST;
@@ -16,48 +23,52 @@ namespace parser {
     }
 
     static int getTokPrec() {
-        if (!isascii(curTok))
-            return -1;
-        auto prec = binopPrec.find(static_cast<char>(curTok));
-        if (prec != binopPrec.end())
-            return prec->second;
-        return -1;
+        int prec = binops.lookup(curTok).prec;
+        return prec > 0 ? prec : -1;
     }
 
-    std::unique_ptr<ExprAST> logError(const char* str) {
+    /// The last syntax error reported.
+    static std::string lastError;
+
+    /// Maps a function name in the source to the function it refers to, for
+    /// callers that give each source its own scope; defining is true for the
+    /// name of a def. Names are used as written when unset.
+    static std::function<std::string(const std::string &name, bool defining)> resolveName;
+
+    static std::unique_ptr<ExprAST> logError(const char* str) {
         fprintf(stderr, "Error: %s\n", str);
+        lastError = str;
         return nullptr;
     }
 
-    std::unique_ptr<PrototypeAST> logErrorP(const char* str) {
+    static std::unique_ptr<PrototypeAST> logErrorP(const char* str) {
         fprintf(stderr, "Error: %s\n", str);
+        lastError = str;
         return nullptr;
     }
 
     static std::unique_ptr<ExprAST> parseExpr();
 
-    static std::unique_ptr<ExprAST> parseNumExpr() {
-        auto res = std::make_unique<NumberExprAST>(numVal);
-        getNextToken();
+    /// makeExpr - construct an AST node and tag it with the location it was parsed at.
+    template<typename T, typename... Args>
+    static std::unique_ptr<ExprAST> makeExpr(SourceLocation loc, Args &&... args) {
+        auto res = std::make_unique<T>(std::forward<Args>(args)...);
+        res->setLoc(loc);
         return std::move(res);
     }
 
-    static std::unique_ptr<ExprAST> parseParenExpr() {
-        getNextToken();
-        auto val = parseExpr();
-        if (val == nullptr)
-            return nullptr;
-        if (curTok != ')')
-            return logError("Expected ')'");
+    static std::unique_ptr<ExprAST> parseNumExpr() {
+        auto res = makeExpr<NumberExprAST>(curLoc, numVal);
         getNextToken();
-        return val;
+        return std::move(res);
     }
 
     static std::unique_ptr<ExprAST> parseIdentExpr() {
         auto idName = identStr;
+        auto loc = curLoc;
         getNextToken();
         if (curTok != '(')
-            return std::make_unique<VariableExprAST>(idName);
+            return makeExpr<VariableExprAST>(loc, idName);
 
         getNextToken();  // eat '('
         std::vector<std::unique_ptr<ExprAST>> args;
@@ -75,10 +86,13 @@ namespace parser {
             }
         }
         getNextToken();  // eat '('
-        return std::make_unique<CallExprAST>(idName, std::move(args));
+        if (resolveName)
+            idName = resolveName(idName, false);
+        return makeExpr<CallExprAST>(loc, idName, std::move(args));
     }
 
     static std::unique_ptr<ExprAST> parseIfExpr() {
+        auto loc = curLoc;
         getNextToken();
         auto cond = parseExpr();
         if (!cond)
@@ -97,16 +111,35 @@ namespace parser {
         auto else_ = parseExpr();
         if (!else_)
             return nullptr;
-        return std::make_unique<IfExprAST>(std::move(cond), std::move(then), std::move(else_));
+        return makeExpr<IfExprAST>(loc, std::move(cond), std::move(then), std::move(else_));
     }
 
     static std::unique_ptr<ExprAST> parseForExpr() {
+        auto loc = curLoc;
         getNextToken();
         if (curTok != Token::IDENT)
             return logError("Expected identifier after 'for'");
         std::string idName = identStr;
         getNextToken();
 
+        // "for sum i = ..." reduces the body's values; without a second
+        // identifier, sum is just the induction variable's name.
+        auto reduction = ForExprAST::Reduction::None;
+        if (curTok == Token::IDENT) {
+            static const std::map<std::string, ForExprAST::Reduction> reductions = {
+                    {"sum",     ForExprAST::Reduction::Sum},
+                    {"product", ForExprAST::Reduction::Product},
+                    {"min",     ForExprAST::Reduction::Min},
+                    {"max",     ForExprAST::Reduction::Max},
+            };
+            auto it = reductions.find(idName);
+            if (it == reductions.end())
+                return logError("Expected sum, product, min or max before the loop variable");
+            reduction = it->second;
+            idName = identStr;
+            getNextToken();
+        }
+
         if (curTok != '=')
             return logError("Expected '=' after identifier");
         getNextToken();
@@ -137,9 +170,11 @@ namespace parser {
         auto body = parseExpr();
         if (!body)
             return nullptr;
-        return std::make_unique<ForExprAST>(idName, std::move(start), std::move(end), std::move(step), std::move(body));
+        return makeExpr<ForExprAST>(loc, idName, std::move(start), std::move(end), std::move(step), std::move(body),
+                                     reduction);
     }
     static std::unique_ptr<ExprAST> parseVarExpr() {
+        auto loc = curLoc;
         getNextToken();
         std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> varNames;
         if (curTok != Token::IDENT)
@@ -167,7 +202,7 @@ namespace parser {
         auto body = parseExpr();
         if (!body)
             return nullptr;
-        return std::make_unique<VarExprAST>(std::move(varNames), std::move(body));
+        return makeExpr<VarExprAST>(loc, std::move(varNames), std::move(body));
     }
 
     static std::unique_ptr<ExprAST> parsePrimary() {
@@ -176,8 +211,6 @@ namespace parser {
                 return parseIdentExpr();
             case Token::NUM:
                 return parseNumExpr();
-            case '(':
-                return parseParenExpr();
             case Token::IF:
                 return parseIfExpr();
             case Token::FOR:
@@ -189,44 +222,118 @@ namespace parser {
         }
     }
 
-    static std::unique_ptr<ExprAST> parseUnaryExpr() {
-        if (!isascii(curTok) || curTok == '(')
-            return parsePrimary();
-        int opcode = curTok;
-        getNextToken();
-        if (auto operand = parseUnaryExpr())
-            return std::make_unique<UnaryExprAST>(opcode, std::move(operand));
-        return nullptr;
-    }
+    /// How deeply calls, if, for and var may nest inside each other's
+    /// subexpressions, which parse recursively.
+    constexpr unsigned maxNesting = 1000;
+    static unsigned nesting;
+
+    /// How deep an expression tree may be. Codegen and the other passes over
+    /// the AST recurse once per level, so this is what bounds their stack use.
+    constexpr unsigned maxDepth = 10000;
+
+    /// Depth of the deepest expression parseExpr returned since it was reset.
+    static unsigned parsedDepth;
+
+    /// expression ::= unary (binop unary)*
+    /// unary ::= primary | '(' expression ')' | unop unary
+    ///
+    /// Operator precedence parsing on explicit stacks: a binary operator waits
+    /// on ops until one that binds less tightly arrives, unary operators wait
+    /// for their operand and '(' waits for its ')'. Long operator chains, runs
+    /// of unary operators and deep parentheses parse in linear time without
+    /// recursing.
+    static std::unique_ptr<ExprAST> parseExpr() {
+        if (nesting >= maxNesting)
+            return logError("Expression nested too deeply");
+        struct Nested {
+            Nested() { nesting++; }
+            ~Nested() { nesting--; }
+        } nested;
+
+        struct PendingOp {
+            enum Kind { Paren, Unary, Binary } kind;
+            int op;
+            int prec;
+            SourceLocation loc;
+        };
+        std::vector<PendingOp> ops;
+        struct Operand {
+            std::unique_ptr<ExprAST> expr;
+            unsigned depth;
+        };
+        std::vector<Operand> operands;
+        unsigned parens = 0;
+
+        auto reduce = [&] {
+            auto top = ops.back();
+            ops.pop_back();
+            auto rhs = std::move(operands.back());
+            operands.pop_back();
+            if (top.kind == PendingOp::Unary) {
+                operands.push_back({makeExpr<UnaryExprAST>(top.loc, top.op, std::move(rhs.expr)), rhs.depth + 1});
+                return;
+            }
+            auto &lhs = operands.back();
+            lhs.expr = makeExpr<BinaryExprAST>(top.loc, top.op, std::move(lhs.expr), std::move(rhs.expr));
+            lhs.depth = std::max(lhs.depth, rhs.depth) + 1;
+        };
+        // Reduce the operators since the innermost '(' that bind at least as
+        // tightly as one of precedence prec; unary operators bind tightest.
+        auto reduceFor = [&](int prec, bool rightAssoc) {
+            while (!ops.empty() && ops.back().kind != PendingOp::Paren &&
+                   (ops.back().prec > prec || (ops.back().prec == prec && !rightAssoc))) {
+                reduce();
+                if (operands.back().depth > maxDepth)
+                    return false;
+            }
+            return true;
+        };
 
-    static std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> lhs) {
         while (true) {
-            int tokPrec = getTokPrec();
-            if (tokPrec < exprPrec)
-                return lhs;
-            int binOp = curTok;
-            getNextToken();
-            auto rhs = parseUnaryExpr();
-            if (!rhs)
+            // A character before an operand is a '(' or a unary operator; the
+            // separators and ')' never start an operand and are left to parsePrimary
+            // to report.
+            while (isascii(curTok) && curTok != ',' && curTok != ';' && curTok != ')') {
+                if (curTok == '(') {
+                    ops.push_back({PendingOp::Paren, curTok, 0, curLoc});
+                    parens++;
+                } else {
+                    ops.push_back({PendingOp::Unary, curTok, INT_MAX, curLoc});
+                }
+                getNextToken();
+            }
+            auto outer = std::exchange(parsedDepth, 0);
+            auto operand = parsePrimary();
+            if (!operand)
                 return nullptr;
-            int nextPrec = getTokPrec();
-            if (tokPrec < nextPrec) {
-                rhs = parseBinOpRHS(tokPrec + 1, std::move(rhs));
-                if (!rhs)
-                    return nullptr;
+            operands.push_back({std::move(operand), std::exchange(parsedDepth, outer) + 1});
+
+            // ')' closes a '(' of this expression; one of an enclosing call is left to it.
+            while (curTok == ')' && parens) {
+                if (!reduceFor(INT_MIN, false))
+                    return logError("Expression nested too deeply");
+                ops.pop_back();
+                parens--;
+                getNextToken();
             }
-            lhs = std::make_unique<BinaryExprAST>(binOp, std::move(lhs), std::move(rhs));
+            int prec = getTokPrec();
+            if (prec < 0)
+                break;
+            if (!reduceFor(prec, binops.lookup(curTok).rightAssoc))
+                return logError("Expression nested too deeply");
+            ops.push_back({PendingOp::Binary, curTok, prec, curLoc});
+            getNextToken();
         }
+        if (parens)
+            return logError("Expected ')'");
+        if (!reduceFor(INT_MIN, false))
+            return logError("Expression nested too deeply");
+        parsedDepth = std::max(parsedDepth, operands.back().depth);
+        return std::move(operands.back().expr);
     }
 
-    static std::unique_ptr<ExprAST> parseExpr() {
-        auto lhs = parseUnaryExpr();
-        if (!lhs)
-            return nullptr;
-        return parseBinOpRHS(0, std::move(lhs));
-    }
-
-    static std::unique_ptr<PrototypeAST> parseProto() {
+    static std::unique_ptr<PrototypeAST> parseProto(bool defining = false) {
+        auto loc = curLoc;
         std::string fnName;
         enum Kind {
             IDENTIFIER = 0,
@@ -237,7 +344,7 @@ namespace parser {
         unsigned binaryPrecedence = 30;
         switch (curTok) {
             case Token::IDENT:
-                fnName = identStr;
+                fnName = resolveName ? resolveName(identStr, defining) : identStr;
                 kind = Kind::IDENTIFIER;
                 getNextToken();
                 break;
@@ -280,12 +387,14 @@ namespace parser {
         if (kind != Kind::IDENTIFIER && argNames.size() != kind) {
             return logErrorP("Invalid num of args");
         }
-        return std::make_unique<PrototypeAST>(fnName, argNames, kind != Kind::IDENTIFIER, binaryPrecedence);
+        auto proto = std::make_unique<PrototypeAST>(fnName, argNames, kind != Kind::IDENTIFIER, binaryPrecedence);
+        proto->setLine(loc.line);
+        return proto;
     }
 
     static std::unique_ptr<FunctionAST> parseDefn() {
         getNextToken();
-        auto proto = parseProto();
+        auto proto = parseProto(true);
         if (!proto)
             return nullptr;
         if (auto expr = parseExpr()) {
@@ -295,8 +404,10 @@ namespace parser {
     }
 
     static std::unique_ptr<FunctionAST> parseTopLevelExpr() {
+        auto loc = curLoc;
         if (auto expr = parseExpr()) {
             auto proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+            proto->setLine(loc.line);
             return std::make_unique<FunctionAST>(std::move(proto), std::move(expr));
         }
         return nullptr;
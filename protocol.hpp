@@ -0,0 +1,45 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Framing of the --serve socket protocol. Each request and each response is a
+// little-endian u32 payload length followed by the payload. A request holds
+// Kaleidoscope source, any number of statements; its response has one line per
+// statement, in order: "def <name>", "extern <name>", the value of an
+// expression in shortest round-trip form, or "error: <message>".
+namespace protocol {
+    constexpr uint32_t maxFrameSize = 16 << 20;
+
+    inline void appendFrame(std::string &out, std::string_view payload) {
+        auto n = static_cast<uint32_t>(payload.size());
+        for (int i = 0; i < 4; i++)
+            out += static_cast<char>(n >> (8 * i));
+        out += payload;
+    }
+
+    /// Length of the frame at the start of in; 0 until the header is complete.
+    inline uint32_t frameSize(std::string_view in) {
+        if (in.size() < 4)
+            return 0;
+        uint32_t n = 0;
+        for (int i = 0; i < 4; i++)
+            n |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        return n;
+    }
+
+    /// Move the first complete frame's payload from in to payload. Returns
+    /// false if in does not hold a whole frame yet.
+    inline bool takeFrame(std::string &in, std::string &payload) {
+        if (in.size() < 4 || in.size() - 4 < frameSize(in))
+            return false;
+        uint32_t n = frameSize(in);
+        payload.assign(in, 4, n);
+        in.erase(0, 4 + n);
+        return true;
+    }
+}
+
+#endif //PROTOCOL_HPP
@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <vector>
+#include <llvm/ADT/StringSet.h>
+#include "registry.hpp"
+
+std::map<std::string, FunctionInfo> functionInfos;
+
+static bool containsLoop(const AST::ExprAST &expr) {
+    if (dynamic_cast<const AST::ForExprAST*>(&expr))
+        return true;
+    bool found = false;
+    expr.forEachChild([&](const AST::ExprAST &child) { found = found || containsLoop(child); });
+    return found;
+}
+
+std::set<std::string> registerDefinition(const std::string &name, const AST::ExprAST &body) {
+    auto &info = functionInfos[name];
+    info.version++;
+    info.external = false;
+    info.callees = AST::collectCallees(body);
+    info.hasLoop = containsLoop(body);
+    return updateEffects();
+}
+
+std::set<std::string> registerExtern(const std::string &name) {
+    auto &info = functionInfos[name];
+    info.version++;
+    info.external = true;
+    info.callees.clear();
+    info.hasLoop = false;
+    info.specialized.clear();
+    return updateEffects();
+}
+
+bool isExternal(const std::string &name) {
+    auto it = functionInfos.find(name);
+    return it != functionInfos.end() && it->second.external;
+}
+
+bool isPureLibmFunction(const std::string &name) {
+    static const llvm::StringSet<> pure = {
+            "sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh", "tanh", "asinh", "acosh",
+            "atanh", "exp", "exp2", "expm1", "log", "log2", "log10", "log1p", "pow", "sqrt", "cbrt", "hypot",
+            "fabs", "floor", "ceil", "trunc", "round", "rint", "nearbyint", "copysign", "fmin", "fmax", "fma",
+            "fmod", "erf", "erfc", "tgamma",
+    };
+    return pure.count(name);
+}
+
+std::set<std::string> updateEffects() {
+    std::map<std::string, FunctionInfo> before = functionInfos;
+    auto isDefined = [](const std::string &name) {
+        auto it = functionInfos.find(name);
+        return it != functionInfos.end() && !it->second.external;
+    };
+
+    // Optimistically assume every definition has an effect, then drop it from
+    // definitions calling something without it until nothing changes; this
+    // keeps e.g. mutually recursive pure functions readnone.
+    for (auto &[name, info]: functionInfos) {
+        if (info.external) {
+            info.readNone = info.willReturn = isPureLibmFunction(name);
+            info.noRecurse = true;
+        } else {
+            info.readNone = true;
+            info.noRecurse = !transitiveCallees(info.callees).count(name);
+        }
+    }
+    auto propagate = [&](bool FunctionInfo::*effect) {
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto &[name, info]: functionInfos) {
+                if (info.external || !(info.*effect))
+                    continue;
+                bool holds = std::all_of(info.callees.begin(), info.callees.end(), [&](const std::string &callee) {
+                    auto it = functionInfos.find(callee);
+                    return it != functionInfos.end() && it->second.*effect;
+                });
+                if (!holds) {
+                    info.*effect = false;
+                    changed = true;
+                }
+            }
+        }
+    };
+    propagate(&FunctionInfo::readNone);
+    for (auto &[name, info]: functionInfos)
+        if (!info.external)
+            info.willReturn = info.readNone && info.noRecurse && !info.hasLoop;
+    propagate(&FunctionInfo::willReturn);
+
+    std::set<std::string> weakened;
+    for (auto &[name, info]: functionInfos) {
+        auto it = before.find(name);
+        if (it == before.end() || !isDefined(name))
+            continue;
+        auto &old = it->second;
+        if ((old.readNone && !info.readNone) || (old.willReturn && !info.willReturn) ||
+            (old.noRecurse && !info.noRecurse))
+            weakened.insert(name);
+    }
+    return weakened;
+}
+
+std::set<std::string> transitiveCallees(const std::set<std::string> &roots) {
+    std::set<std::string> seen;
+    std::vector<std::string> worklist(roots.begin(), roots.end());
+    while (!worklist.empty()) {
+        auto name = worklist.back();
+        worklist.pop_back();
+        if (!seen.insert(name).second)
+            continue;
+        auto it = functionInfos.find(name);
+        if (it != functionInfos.end())
+            worklist.insert(worklist.end(), it->second.callees.begin(), it->second.callees.end());
+    }
+    return seen;
+}
+
+bool allReadNone(const std::set<std::string> &functions) {
+    return std::all_of(functions.begin(), functions.end(), [](const std::string &name) {
+        auto it = functionInfos.find(name);
+        return it != functionInfos.end() && it->second.readNone;
+    });
+}
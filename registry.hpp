@@ -0,0 +1,58 @@
+#ifndef REGISTRY_HPP
+#define REGISTRY_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include "ast.hpp"
+
+/// FunctionInfo - what the session knows about a named function beyond its prototype.
+struct FunctionInfo {
+    /// Bumped on every (re)definition or extern declaration of the name.
+    unsigned version = 0;
+    /// Declared with extern and resolved in the host process rather than defined in Kaleidoscope.
+    bool external = true;
+    /// Functions called directly by the body.
+    std::set<std::string> callees;
+    /// The body contains a loop, which may not terminate.
+    bool hasLoop = false;
+    /// Definitions cloned into this function's module by call-site specialization;
+    /// it must be recompiled when one of them changes.
+    std::set<std::string> specialized;
+
+    // Effects inferred by updateEffects. Modules compiled while an effect held
+    // rely on it, both in the function's own body and in its callers.
+    /// Reads and writes no memory visible to the caller, and does not unwind.
+    bool readNone = false;
+    bool willReturn = false;
+    bool noRecurse = false;
+};
+
+extern std::map<std::string, FunctionInfo> functionInfos;
+
+/// Record a (re)definition and update effects; returns the functions whose
+/// effects got weaker, see updateEffects.
+std::set<std::string> registerDefinition(const std::string &name, const AST::ExprAST &body);
+
+std::set<std::string> registerExtern(const std::string &name);
+
+/// Recompute the effects of every function from the call graph. A definition
+/// is readnone if everything it calls is; willreturn if it is also loop-free,
+/// non-recursive and only calls functions that return. Returns the functions
+/// that lost an effect they had before.
+std::set<std::string> updateEffects();
+
+/// libm functions whose result only depends on their arguments; Kaleidoscope
+/// never observes errno.
+bool isPureLibmFunction(const std::string &name);
+
+/// True if name was last declared with extern.
+bool isExternal(const std::string &name);
+
+/// The given functions and every function they call, directly or indirectly.
+std::set<std::string> transitiveCallees(const std::set<std::string> &roots);
+
+/// True if every function in the set is readnone, so calling them cannot have side effects.
+bool allReadNone(const std::set<std::string> &functions);
+
+#endif //REGISTRY_HPP
@@ -0,0 +1,125 @@
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/bit.h>
+#include "reload.hpp"
+#include "parser.hpp"
+#include "registry.hpp"
+#include "KaleidoscopeJIT.h"
+
+using namespace parser;
+
+std::optional<llvm::orc::VModuleKey> addDefinition(std::unique_ptr<FunctionAST> fn, bool print);
+bool addExtern(std::unique_ptr<PrototypeAST> proto, bool print);
+
+namespace {
+    /// A def or extern as it was when its file was last reloaded.
+    struct Item {
+        llvm::hash_code hash;
+        /// The version it left its name at; any other means the name was
+        /// defined again since, from elsewhere.
+        unsigned version;
+    };
+
+    /// By file, then by the name each item defines.
+    std::map<std::string, std::map<std::string, Item>> reloaded;
+
+    bool isItemBoundary(int tok) {
+        return tok == Token::DEF || tok == Token::EXTERN || tok == Token::COMMAND || tok == ';' ||
+               tok == Token::EOF_;
+    }
+
+    /// Where the def or extern keyword just lexed starts.
+    struct Mark {
+        long offset;
+        SourceLocation loc;
+    };
+
+    Mark markKeyword() {
+        long end = ftell(lexInput) - (prevChar == EOF ? 0 : 1);
+        return {end - static_cast<long>(identStr.size()), curLoc};
+    }
+
+    /// Lex again from a mark, leaving its keyword the current token.
+    void rewind(const Mark &mark) {
+        fseek(lexInput, mark.offset, SEEK_SET);
+        prevChar = ' ';
+        // Reading the keyword's first character brings the location back to where it was.
+        lexLoc = {mark.loc.line, mark.loc.col - 1};
+        getNextToken();
+    }
+
+    /// Hash the tokens from the keyword up to the next item, and name the
+    /// function the item defines if it gets that far. Operators are hashed
+    /// with the precedence they parse at, except the one an item defines.
+    llvm::hash_code hashItem(std::string &name) {
+        auto hash = llvm::hash_value(curTok);
+        int prev = curTok;
+        for (getNextToken(); !isItemBoundary(curTok); prev = curTok, getNextToken()) {
+            bool named = prev == Token::DEF || prev == Token::EXTERN;
+            bool defined = prev == Token::BINARY || prev == Token::UNARY;
+            if (curTok == Token::IDENT) {
+                hash = llvm::hash_combine(hash, curTok, identStr);
+                if (named && name.empty())
+                    name = identStr;
+            } else if (curTok == Token::NUM) {
+                hash = llvm::hash_combine(hash, curTok, llvm::bit_cast<uint64_t>(numVal));
+            } else if (defined) {
+                hash = llvm::hash_combine(hash, curTok);
+                if (name.empty() && isascii(curTok))
+                    name = (prev == Token::BINARY ? "binary" : "unary") + std::string(1, static_cast<char>(curTok));
+            } else {
+                auto op = binops.lookup(curTok);
+                hash = llvm::hash_combine(hash, curTok, op.prec, op.rightAssoc);
+            }
+        }
+        return hash;
+    }
+}
+
+bool reloadFile(const std::string &path) {
+    FILE* in = fopen(path.c_str(), "r");
+    if (!in) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    auto &items = reloaded[path];
+    unsigned total = 0, compiled = 0;
+    resetLexer(in);
+    getNextToken();
+    while (curTok != Token::EOF_) {
+        if (curTok != Token::DEF && curTok != Token::EXTERN) {
+            getNextToken();
+            continue;
+        }
+        total++;
+        auto mark = markKeyword();
+        std::string name;
+        auto hash = hashItem(name);
+        auto item = items.find(name);
+        auto info = functionInfos.find(name);
+        if (item != items.end() && item->second.hash == hash && info != functionInfos.end() &&
+            info->second.version == item->second.version)
+            continue;
+
+        rewind(mark);
+        compiled++;
+        bool ok;
+        if (curTok == Token::DEF) {
+            auto fn = parseDefn();
+            ok = fn && addDefinition(std::move(fn), false);
+        } else {
+            auto proto = parseExtern();
+            ok = proto && addExtern(std::move(proto), false);
+        }
+        info = functionInfos.find(name);
+        if (ok && info != functionInfos.end())
+            items[name] = {hash, info->second.version};
+        else
+            items.erase(name);
+    }
+    fclose(in);
+    fprintf(stdout, "Reloaded %s: compiled %u of %u definitions\n", path.c_str(), compiled, total);
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef RELOAD_HPP
+#define RELOAD_HPP
+
+#include <string>
+
+/// Bring the session's definitions and externs in line with a source file.
+/// Each def and extern is hashed by its tokens, along with the precedence of
+/// every operator among them, and only those whose hash changed since the
+/// file was last reloaded, or that were redefined from elsewhere since, are
+/// parsed and compiled again; compiling them recompiles the definitions that
+/// inlined or relied on their old bodies. Everything else keeps its JIT code.
+/// Top-level expressions and commands in the file are skipped, and
+/// definitions removed from it stay defined. Returns false if the file cannot
+/// be read.
+bool reloadFile(const std::string &path);
+
+#endif //RELOAD_HPP
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.hpp"
+#include "executor.hpp"
+#include "exprcache.hpp"
+#include "parser.hpp"
+#include "protocol.hpp"
+#include "registry.hpp"
+#include "KaleidoscopeJIT.h"
+
+using namespace llvm;
+using namespace parser;
+
+extern std::unique_ptr<orc::KaleidoscopeJIT> jit;
+extern std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+extern std::map<std::string, std::unique_ptr<FunctionAST>> definitions;
+extern std::unique_ptr<ExprCache> exprCache;
+extern std::unique_ptr<ExecutorPool> executors;
+
+orc::VModuleKey addModuleToJIT(bool retain = false);
+void initModule();
+std::optional<orc::VModuleKey> addDefinition(std::unique_ptr<FunctionAST> fn, bool print);
+bool addExtern(std::unique_ptr<PrototypeAST> proto, bool print);
+
+namespace {
+    struct Job {
+        uint64_t client;
+        double (*fn)();
+        double result;
+    };
+
+    /// Threads running compiled expressions. Finished jobs are collected by the
+    /// event loop, which a byte written to wakeFd wakes up.
+    class WorkerPool {
+    public:
+        WorkerPool(unsigned n, int wakeFd) : wakeFd(wakeFd) {
+            for (unsigned i = 0; i < n; i++)
+                threads.emplace_back([this] { work(); });
+        }
+
+        ~WorkerPool() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (auto &t: threads)
+                t.join();
+        }
+
+        void submit(const Job &job) {
+            {
+                std::lock_guard lock(mutex);
+                pending.push_back(job);
+            }
+            ready.notify_one();
+        }
+
+        std::vector<Job> takeFinished() {
+            std::lock_guard lock(mutex);
+            return std::exchange(finished, {});
+        }
+
+    private:
+        void work() {
+            std::unique_lock lock(mutex);
+            while (true) {
+                ready.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (stopping)
+                    return;
+                auto job = pending.front();
+                pending.pop_front();
+                lock.unlock();
+                job.result = job.fn();
+                lock.lock();
+                finished.push_back(job);
+                char c = 0;
+                while (write(wakeFd, &c, 1) < 0 && errno == EINTR) {}
+            }
+        }
+
+        int wakeFd;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Job> pending;
+        std::vector<Job> finished;
+        bool stopping = false;
+    };
+
+    /// A statement of a request, parsed when the request arrives.
+    struct Statement {
+        std::unique_ptr<FunctionAST> defn;
+        std::unique_ptr<PrototypeAST> proto;
+        std::unique_ptr<FunctionAST> expr;
+        std::string error;
+    };
+
+    struct Client {
+        int fd;
+        uint64_t id;
+        /// A client's own functions are compiled as "<prefix><name>".
+        std::string prefix;
+        /// Names the client has defined.
+        std::set<std::string> scope;
+        /// Externs the client declared that clients brought into the session.
+        std::set<std::string> externs;
+        std::string in, out;
+        std::deque<std::string> requests;
+        /// The request being evaluated: its statements, the next to run and the
+        /// response so far. Statements run one at a time, so a definition never
+        /// replaces code an earlier expression of the same client is running.
+        std::vector<Statement> statements;
+        size_t next = 0;
+        std::string response;
+        bool running = false;
+        /// The expression being run and its module.
+        double (*runningFn)() = nullptr;
+        orc::VModuleKey runningKey = 0;
+        /// The running expression only calls readnone functions; its result
+        /// goes into the expression cache under this key.
+        std::optional<FoldingSetNodeID> cacheKey;
+        std::set<std::string> cacheDeps;
+        bool closed = false;
+    };
+
+    std::map<uint64_t, Client> clients;
+    /// Externs that clients brought into the session, and how many connected
+    /// clients declared each; the last one to leave takes it out again.
+    std::map<std::string, unsigned> clientExterns;
+    std::unique_ptr<WorkerPool> workers;
+    unsigned exprCount = 0;
+
+    std::vector<Statement> parseRequest(Client &c, std::string &source) {
+        std::vector<Statement> statements;
+        FILE* in = fmemopen(source.data(), source.size(), "r");
+        if (!in) {
+            statements.push_back({nullptr, nullptr, nullptr, strerror(errno)});
+            return statements;
+        }
+        resetLexer(in);
+        resolveName = [&c](const std::string &name, bool defining) {
+            if (defining)
+                c.scope.insert(name);
+            return c.scope.count(name) ? c.prefix + name : name;
+        };
+        getNextToken();
+        while (curTok != Token::EOF_) {
+            Statement st;
+            lastError.clear();
+            switch (curTok) {
+                case ';':
+                    getNextToken();
+                    continue;
+                case Token::DEF:
+                    st.defn = parseDefn();
+                    break;
+                case Token::EXTERN:
+                    st.proto = parseExtern();
+                    break;
+                case Token::COMMAND:
+                    st.error = "Commands are not available to clients";
+                    getNextToken();
+                    break;
+                default:
+                    st.expr = parseTopLevelExpr();
+                    break;
+            }
+            if (!st.defn && !st.proto && !st.expr && st.error.empty()) {
+                st.error = lastError.empty() ? "Syntax error" : lastError;
+                getNextToken();
+            }
+            statements.push_back(std::move(st));
+        }
+        resolveName = nullptr;
+        fclose(in);
+        return statements;
+    }
+
+    std::string formatResult(double result) {
+        char buf[32];
+        return {buf, std::to_chars(buf, buf + sizeof(buf), result).ptr};
+    }
+
+    void appendLine(Client &c, const std::string &line) {
+        c.response += line;
+        c.response += '\n';
+    }
+
+    /// Run the client's statements until one is handed to a worker or executor or the
+    /// request is done, then start on its next request.
+    void advance(Client &c) {
+        while (!c.running) {
+            if (c.next == c.statements.size()) {
+                if (c.next > 0) {
+                    protocol::appendFrame(c.out, c.response);
+                    c.response.clear();
+                    c.statements.clear();
+                    c.next = 0;
+                }
+                if (c.requests.empty() || c.closed)
+                    return;
+                c.statements = parseRequest(c, c.requests.front());
+                c.requests.pop_front();
+                if (c.statements.empty())
+                    protocol::appendFrame(c.out, "");
+                continue;
+            }
+            auto &st = c.statements[c.next++];
+            if (!st.error.empty()) {
+                appendLine(c, "error: " + st.error);
+            } else if (st.defn) {
+                auto name = st.defn->getName();
+                if (name.compare(0, c.prefix.size(), c.prefix) != 0) {
+                    appendLine(c, "error: Operators can only be defined before serving");
+                    continue;
+                }
+                auto local = name.substr(c.prefix.size());
+                if (addDefinition(std::move(st.defn), false)) {
+                    appendLine(c, "def " + local);
+                } else {
+                    if (!definitions.count(name))
+                        c.scope.erase(local);
+                    appendLine(c, "error: Cannot compile " + local);
+                }
+            } else if (st.proto) {
+                // Prototypes are shared by every client, so a client may add an
+                // extern or repeat one but never change its signature.
+                auto name = st.proto->getName();
+                auto known = functionProtos.find(name);
+                if (name.compare(0, c.prefix.size(), c.prefix) == 0 || definitions.count(name)) {
+                    appendLine(c, "error: " + name + " is defined in Kaleidoscope");
+                } else if (known != functionProtos.end() &&
+                           known->second->getArgs().size() != st.proto->getArgs().size()) {
+                    appendLine(c, "error: " + name + " is already declared with a different number of parameters");
+                } else if (known != functionProtos.end()) {
+                    if (clientExterns.count(name) && c.externs.insert(name).second)
+                        clientExterns[name]++;
+                    appendLine(c, "extern " + name);
+                } else if (addExtern(std::move(st.proto), false)) {
+                    if (c.externs.insert(name).second)
+                        clientExterns[name]++;
+                    appendLine(c, "extern " + name);
+                } else
+                    appendLine(c, "error: Cannot compile extern " + name);
+            } else {
+                // Only results are reused, never code: a cached module may be
+                // evicted while another client would still be running it.
+                c.cacheKey.reset();
+                if (exprCache->enabled()) {
+                    auto deps = transitiveCallees(collectCallees(st.expr->getBody()));
+                    if (allReadNone(deps)) {
+                        auto key = ExprCache::makeKey(st.expr->getBody(), deps);
+                        if (auto* hit = exprCache->lookup(key); hit && hit->result) {
+                            appendLine(c, formatResult(*hit->result));
+                            continue;
+                        }
+                        c.cacheKey = key;
+                        c.cacheDeps = std::move(deps);
+                    }
+                }
+                auto* fnIR = st.expr->codegen();
+                functionProtos.erase("__anon_expr");
+                if (!fnIR) {
+                    appendLine(c, "error: Cannot compile expression");
+                    continue;
+                }
+                // Expressions stay resident while they run, so each needs a symbol of its own.
+                auto name = "__anon_expr.serve." + std::to_string(++exprCount);
+                fnIR->setName(name);
+                auto key = addModuleToJIT();
+                initModule();
+                auto sym = jit->findSymbol(name);
+                assert(sym && "Function not found");
+                auto fp = (double (*)()) (intptr_t) cantFail(sym.getAddress());
+                c.running = true;
+                c.runningFn = fp;
+                c.runningKey = key;
+                if (executors)
+                    executors->start(c.id, fp);
+                else
+                    workers->submit({c.id, fp, 0});
+            }
+        }
+    }
+
+    /// Forget everything the client defined: every module compiled for its
+    /// definitions, including recompiles on its behalf, their stubs, and the
+    /// externs only it still declares.
+    void dropClient(Client &c) {
+        close(c.fd);
+        for (auto &local: c.scope) {
+            auto name = c.prefix + local;
+            definitions.erase(name);
+            functionProtos.erase(name);
+            functionInfos.erase(name);
+            exprCache->invalidate(name);
+            jit->removeDefinition(name);
+        }
+        for (auto &name: c.externs) {
+            if (--clientExterns[name])
+                continue;
+            clientExterns.erase(name);
+            functionProtos.erase(name);
+            functionInfos.erase(name);
+            exprCache->invalidate(name);
+        }
+        updateEffects();
+    }
+
+    /// The client's running expression is done; None if its executor died.
+    void finish(uint64_t id, std::optional<double> result) {
+        auto &c = clients.at(id);
+        c.running = false;
+        if (c.cacheKey && result)
+            exprCache->insert(*c.cacheKey, c.runningKey, c.runningFn, *result, std::move(c.cacheDeps));
+        else
+            jit->removeModule(c.runningKey);
+        appendLine(c, result ? formatResult(*result) : "error: Executor died");
+        advance(c);
+    }
+
+    void finishJobs() {
+        if (executors) {
+            for (auto &r: executors->collect())
+                finish(r.tag, r.value);
+        } else {
+            for (auto &job: workers->takeFinished())
+                finish(job.client, job.result);
+        }
+    }
+
+    /// Read what the client sent; false once it has closed the connection.
+    bool readFrom(Client &c) {
+        char buf[1 << 16];
+        while (true) {
+            ssize_t n = read(c.fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0)
+                return false;
+            c.in.append(buf, n);
+            if (protocol::frameSize(c.in) > protocol::maxFrameSize)
+                return false;
+            std::string payload;
+            while (protocol::takeFrame(c.in, payload))
+                c.requests.push_back(std::move(payload));
+        }
+    }
+
+    /// Send what is buffered for the client; false if the connection failed.
+    bool writeTo(Client &c) {
+        while (!c.out.empty()) {
+            ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n < 0)
+                return false;
+            c.out.erase(0, n);
+        }
+        return true;
+    }
+}
+
+bool runServer(const std::string &path, unsigned numWorkers) {
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", path.c_str());
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listenFd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    int wake[2];
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+        fprintf(stderr, "Error: Cannot create pipe: %s\n", strerror(errno));
+        return false;
+    }
+    if (!executors)
+        workers = std::make_unique<WorkerPool>(
+                numWorkers ? numWorkers : std::max(1u, std::thread::hardware_concurrency()), wake[1]);
+    fprintf(stderr, "Serving on %s\n", path.c_str());
+
+    uint64_t nextId = 0;
+    std::vector<pollfd> fds;
+    std::vector<uint64_t> fdClients;
+    while (true) {
+        fds = {{listenFd, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        if (executors)
+            for (int fd: executors->descriptors())
+                fds.push_back({fd, POLLIN, 0});
+        size_t firstClient = fds.size();
+        fdClients.assign(firstClient, 0);
+        for (auto &[id, c]: clients) {
+            fds.push_back({c.fd, static_cast<short>(POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0});
+            fdClients.push_back(id);
+        }
+        bool finished = executors && executors->hasFinished();
+        if (poll(fds.data(), fds.size(), finished ? 0 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+            return false;
+        }
+        for (size_t i = 1; i < firstClient; i++)
+            finished = finished || fds[i].revents;
+        if (finished) {
+            char buf[256];
+            while (read(wake[0], buf, sizeof(buf)) > 0) {}
+            finishJobs();
+        }
+        for (size_t i = firstClient; i < fds.size(); i++) {
+            auto it = clients.find(fdClients[i]);
+            if (it == clients.end() || !fds[i].revents)
+                continue;
+            auto &c = it->second;
+            bool ok = !(fds[i].revents & POLLIN) || readFrom(c);
+            if (ok)
+                advance(c);
+            ok = ok && writeTo(c);
+            if (!ok)
+                c.closed = true;
+            // A client whose expression is still running is dropped when it finishes.
+            if (c.closed && !c.running) {
+                dropClient(c);
+                clients.erase(it);
+            }
+        }
+        // Clients that closed while their expression ran.
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (it->second.closed && !it->second.running) {
+                dropClient(it->second);
+                it = clients.erase(it);
+            } else {
+                writeTo(it->second);
+                ++it;
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                auto id = ++nextId;
+                auto &c = clients[id];
+                c.fd = fd;
+                c.id = id;
+                c.prefix = "client" + std::to_string(id) + ".";
+            }
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <string>
+
+/// Serve evaluation requests on a Unix domain socket at path until the process
+/// is killed, see protocol.hpp for the framing. Everything defined before is
+/// shared by all clients; definitions made by a client are only visible to it
+/// and are dropped when it disconnects. Compilation happens on the calling
+/// thread, which also runs the event loop; expressions run on a pool of
+/// worker threads, or on the executor processes if there are any. Returns
+/// false if the socket cannot be set up.
+bool runServer(const std::string &path, unsigned workers);
+
+#endif //SERVER_HPP
@@ -0,0 +1,323 @@
+// The compiler state shared by every driver: the REPL and --serve in main.cpp
+// and kaleidoscope-bench. Other files declare what they use of it extern.
+
+#include <optional>
+#include "llvm/IR/IRBuilder.h"
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Scalar/LICM.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Scalar/LoopRotation.h>
+#include <llvm/Transforms/Scalar/LoopUnrollPass.h>
+#include <llvm/Transforms/Scalar/SCCP.h>
+#include <llvm/Transforms/Scalar/Reassociate.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Utils/LoopSimplify.h>
+#include <llvm/Transforms/Vectorize/LoopVectorize.h>
+
+#include "ast.hpp"
+#include "binop.hpp"
+#include "debuginfo.hpp"
+#include "executor.hpp"
+#include "exprcache.hpp"
+#include "registry.hpp"
+#include "KaleidoscopeJIT.h"
+
+using namespace llvm;
+using namespace AST;
+
+static cl::opt<bool> perfSupport("perf", cl::desc("Emit /tmp/perf-<pid>.map and jitdump files for jitted code"));
+static cl::opt<bool> gdbSupport("gdb", cl::desc("Register jitted code with the GDB JIT interface"));
+static cl::opt<unsigned> slabSizeKB("jit-slab-size", cl::desc("Size in KiB of the mappings jitted sections are packed into"),
+                                    cl::init(4096));
+static cl::opt<bool> hugePages("jit-huge-pages", cl::desc("Back jitted code slabs with transparent huge pages"));
+static cl::opt<bool> lowLatency("low-latency", cl::desc("Reuse the LLVM context and IR builder across statements and "
+                                                        "discard IR value names"));
+static cl::opt<unsigned> contextReuse("context-reuse", cl::desc("Statements compiled in one pooled LLVM context before "
+                                                                "it is replaced (with --low-latency)"),
+                                      cl::init(1000));
+static cl::opt<unsigned> exprCacheSize("expr-cache", cl::desc("Keep up to N compiled top-level expressions for reuse"),
+                                       cl::init(0));
+static cl::opt<TargetLibraryInfoImpl::VectorLibrary> vectorLibrary(
+        "vector-math", cl::desc("Vector math library loops calling libm functions are vectorized against"),
+        cl::init(TargetLibraryInfoImpl::NoLibrary),
+        cl::values(clEnumValN(TargetLibraryInfoImpl::NoLibrary, "none", "No vector math library"),
+                   clEnumValN(TargetLibraryInfoImpl::LIBMVEC_X86, "libmvec", "glibc's libmvec"),
+                   clEnumValN(TargetLibraryInfoImpl::SVML, "svml", "Intel SVML")));
+static cl::opt<bool> noOpt("O0", cl::desc("Do not optimize generated code"));
+static cl::opt<unsigned> numExecutors("executors", cl::desc("Run top-level expressions in N processes forked from "
+                                                            "the compiler instead of in it"), cl::init(0));
+
+std::unique_ptr<LLVMContext> ctx;
+std::unique_ptr<Module> module;
+std::unique_ptr<IRBuilder<>> builder;
+std::unique_ptr<FunctionPassManager> fpm;
+std::unique_ptr<FunctionAnalysisManager> fam;
+std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
+std::unique_ptr<DebugInfo> debugInfo;
+std::unique_ptr<ExprCache> exprCache;
+std::unique_ptr<ExecutorPool> executors;
+std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+BinopTable binops;
+
+/// The AST of every live definition, kept to recompile it when its callees' effects weaken.
+std::map<std::string, std::unique_ptr<FunctionAST>> definitions;
+
+static std::unique_ptr<LoopAnalysisManager> lam;
+static std::unique_ptr<CGSCCAnalysisManager> cgam;
+static std::unique_ptr<ModuleAnalysisManager> mam;
+static std::optional<DataLayout> dataLayout;
+static unsigned statementsInContext = 0;
+
+/// Build the function pass pipeline once; it is not tied to any module, so every
+/// statement reuses it instead of constructing and initializing its own.
+static void initPassPipeline() {
+    lam = std::make_unique<LoopAnalysisManager>();
+    fam = std::make_unique<FunctionAnalysisManager>();
+    cgam = std::make_unique<CGSCCAnalysisManager>();
+    mam = std::make_unique<ModuleAnalysisManager>();
+    // Registered before the defaults so the vectorizer sees the vector library's
+    // variants of the libm functions.
+    TargetLibraryInfoImpl tlii(jit->getTargetMachine().getTargetTriple());
+    tlii.addVectorizableFunctionsFromVecLib(vectorLibrary);
+    fam->registerPass([tlii] { return TargetLibraryAnalysis(tlii); });
+    PassBuilder pb(&jit->getTargetMachine());
+    pb.registerModuleAnalyses(*mam);
+    pb.registerCGSCCAnalyses(*cgam);
+    pb.registerFunctionAnalyses(*fam);
+    pb.registerLoopAnalyses(*lam);
+    pb.crossRegisterProxies(*lam, *fam, *cgam, *mam);
+
+    // Codegen emits SSA directly, so the pipeline is optional.
+    fpm = std::make_unique<FunctionPassManager>();
+    if (noOpt)
+        return;
+    // Propagates the constants specialized clones are compiled with through branches.
+    fpm->addPass(SCCPPass());
+    fpm->addPass(InstCombinePass());
+    fpm->addPass(ReassociatePass());
+    fpm->addPass(GVN());
+    fpm->addPass(SimplifyCFGPass());
+    // Hoist invariant work (e.g. sqrt(n) in a loop bound) and vectorize loops,
+    // then clean up after the vectorizer.
+    fpm->addPass(LoopSimplifyPass());
+    fpm->addPass(createFunctionToLoopPassAdaptor(LoopRotatePass()));
+    fpm->addPass(createFunctionToLoopPassAdaptor(LICMPass(), true));
+    fpm->addPass(createFunctionToLoopPassAdaptor(LoopFullUnrollPass()));
+    fpm->addPass(LoopVectorizePass());
+    fpm->addPass(InstCombinePass());
+    fpm->addPass(SimplifyCFGPass());
+}
+
+void initModule() {
+    // A module left over must not outlive the context it belongs to.
+    module.reset();
+    // With --low-latency the context (and the builder bound to it) is pooled:
+    // modules are compiled to objects and destroyed as soon as they reach the JIT,
+    // so the context can be reused until it has accumulated enough uniqued
+    // constants and types to be worth recycling.
+    if (!ctx || !lowLatency || ++statementsInContext >= contextReuse) {
+        ctx = std::make_unique<LLVMContext>();
+        ctx->setDiscardValueNames(lowLatency);
+        builder = std::make_unique<IRBuilder<>>(*ctx);
+        statementsInContext = 0;
+    }
+    if (!dataLayout)
+        dataLayout = jit->getTargetMachine().createDataLayout();
+    module = std::make_unique<Module>("my jit", *ctx);
+    module->setDataLayout(*dataLayout);
+    module->setTargetTriple(jit->getTargetMachine().getTargetTriple().str());
+    if (perfSupport || gdbSupport)
+        debugInfo = std::make_unique<DebugInfo>(*module);
+}
+
+/// Hand the current module to the JIT, finishing its debug info first. Retained
+/// modules are kept for @snapshot.
+llvm::orc::VModuleKey addModuleToJIT(bool retain = false) {
+    if (debugInfo)
+        debugInfo->finalize();
+    // Cached analyses refer to the module's functions, which die with it.
+    lam->clear();
+    fam->clear();
+    cgam->clear();
+    mam->clear();
+    return jit->addModule(std::move(module), retain);
+}
+
+/// Compile a live definition again into a module of its own; its stub then
+/// points at the new code.
+void recompile(FunctionAST &fn) {
+    exprCache->invalidate(fn.getName());
+    if (fn.codegen()) {
+        addModuleToJIT(true);
+        initModule();
+    }
+}
+
+/// Modules compiled while a function had an effect rely on it: its own and those
+/// of its direct callers, including callers inside specialized clones. Modules
+/// that cloned a redefined function rely on its old body. Recompile them; the
+/// stubs make callers elsewhere pick up the new code.
+static void recompileDependents(const std::string &redefined, const std::set<std::string> &weakened) {
+    std::set<std::string> stale = weakened;
+    for (auto &[name, info]: functionInfos) {
+        if (info.external)
+            continue;
+        auto callees = info.callees;
+        for (auto &clone: info.specialized)
+            callees.insert(functionInfos[clone].callees.begin(), functionInfos[clone].callees.end());
+        if (info.specialized.count(redefined) ||
+            any_of(weakened, [&](const std::string &callee) { return callees.count(callee); }))
+            stale.insert(name);
+    }
+    stale.erase(redefined);
+    for (auto &name: stale) {
+        auto it = definitions.find(name);
+        if (it == definitions.end()) {
+            fprintf(stderr, "Warning: %s was restored from a snapshot and cannot be recompiled; it may assume "
+                            "stale effects of its callees\n", name.c_str());
+            continue;
+        }
+        recompile(*it->second);
+    }
+}
+
+/// Register and compile a definition, replacing any earlier one, and recompile
+/// what depended on the earlier one. Returns the new module, after printing its
+/// IR when print is set; if it does not compile, the earlier definition stays.
+std::optional<llvm::orc::VModuleKey> addDefinition(std::unique_ptr<FunctionAST> fn, bool print) {
+    // Effects are inferred before codegen so the new body and its own
+    // declaration carry them.
+    auto name = fn->getName();
+    bool wasExternal = isExternal(name);
+    // Restored if the definition does not compile, so a failed body's effects
+    // and signature never apply to the live function.
+    std::optional<FunctionInfo> previousInfo;
+    if (auto it = functionInfos.find(name); it != functionInfos.end())
+        previousInfo = it->second;
+    std::unique_ptr<PrototypeAST> previousProto;
+    if (auto it = functionProtos.find(name); it != functionProtos.end())
+        previousProto = std::make_unique<PrototypeAST>(*it->second);
+    auto weakened = registerDefinition(name, fn->getBody());
+    // In single precision an extern takes doubles and a definition floats, so
+    // callers compiled against the extern must be compiled again.
+    if (wasExternal && numberBits() != 64)
+        weakened.insert(name);
+    // Specialized calls clone the callee's current AST, which must be this one
+    // for recursive calls made while compiling it.
+    auto previous = std::move(definitions[name]);
+    auto &defn = definitions[name] = std::move(fn);
+    if (auto* fnIR = defn->codegen()) {
+        if (print) {
+            fprintf(stdout, "Read fn defn:\n");
+            fnIR->print(outs());
+            fprintf(stdout, "\n");
+        }
+        exprCache->invalidate(name);
+        auto key = addModuleToJIT(true);
+        initModule();
+        recompileDependents(name, weakened);
+        return key;
+    }
+    if (previous)
+        definitions[name] = std::move(previous);
+    else
+        definitions.erase(name);
+    if (previousInfo)
+        functionInfos[name] = *previousInfo;
+    else
+        functionInfos.erase(name);
+    if (previousProto)
+        functionProtos[name] = std::move(previousProto);
+    else
+        functionProtos.erase(name);
+    updateEffects();
+    return std::nullopt;
+}
+
+/// Declare a function resolved in the host process, replacing any definition
+/// of the name. Returns false if the prototype does not compile.
+bool addExtern(std::unique_ptr<PrototypeAST> proto, bool print) {
+    bool wasDefined = functionInfos.count(proto->getName()) && !isExternal(proto->getName());
+    // Registered first, so the declaration has the extern's signature.
+    auto weakened = registerExtern(proto->getName());
+    if (wasDefined && numberBits() != 64)
+        weakened.insert(proto->getName());
+    auto* fnIR = proto->codegen();
+    if (!fnIR)
+        return false;
+    if (print) {
+        fprintf(stdout, "Read extern:\n");
+        fnIR->print(outs());
+        fprintf(stdout, "\n");
+    }
+    exprCache->invalidate(proto->getName());
+    definitions.erase(proto->getName());
+    auto name = proto->getName();
+    functionProtos[name] = std::move(proto);
+    recompileDependents(name, weakened);
+    return true;
+}
+
+/// Run a compiled top-level expression, in an executor process if there are
+/// any; None if its executor died.
+std::optional<double> evaluate(double (*fn)()) {
+    return executors ? executors->run(fn) : fn();
+}
+
+
+static std::unique_ptr<llvm::orc::PerfMapEventListener> perfMap;
+
+/// Create the JIT and what is built around it from the command line options.
+/// Called again, it starts over with a fresh JIT; clearing the definitions
+/// and prototypes of the previous one is up to the caller.
+void initSession() {
+    llvm::orc::SlabAllocator::Options slabOpts;
+    slabOpts.SlabSize = static_cast<size_t>(slabSizeKB) << 10;
+    slabOpts.HugePages = hugePages;
+    slabOpts.Shared = numExecutors > 0;
+    jit = std::make_unique<llvm::orc::KaleidoscopeJIT>(slabOpts);
+    if (numExecutors)
+        executors = std::make_unique<ExecutorPool>(numExecutors, [] { return jit->getGeneration(); },
+                                                   [] { jit->makeTextExecutable(); });
+    exprCache = std::make_unique<ExprCache>(exprCacheSize, [](llvm::orc::VModuleKey k) { jit->removeModule(k); });
+    if (perfSupport) {
+        perfMap = std::make_unique<llvm::orc::PerfMapEventListener>();
+        jit->registerEventListener(*perfMap);
+        if (auto* perfJitDump = JITEventListener::createPerfJITEventListener())
+            jit->registerEventListener(*perfJitDump);
+        else
+            fprintf(stderr, "Warning: LLVM was built without perf support, jitdump disabled\n");
+    }
+    if (gdbSupport)
+        jit->registerEventListener(*JITEventListener::createGDBRegistrationListener());
+
+    if (vectorLibrary != TargetLibraryInfoImpl::NoLibrary) {
+        // The vectorized calls are resolved in the host process like any extern.
+        const char* lib = vectorLibrary == TargetLibraryInfoImpl::LIBMVEC_X86 ? "libmvec.so.1" : "libsvml.so";
+        std::string err;
+        if (sys::DynamicLibrary::LoadLibraryPermanently(lib, &err)) {
+            fprintf(stderr, "Warning: Cannot load %s, vector math disabled: %s\n", lib, err.c_str());
+            vectorLibrary = TargetLibraryInfoImpl::NoLibrary;
+        }
+    }
+    initPassPipeline();
+}
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" double putchard(double X) {
+  fputc((char)X, stderr);
+  return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" double printd(double X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
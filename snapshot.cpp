@@ -0,0 +1,352 @@
+#include <map>
+#include <memory>
+#include <vector>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include "snapshot.hpp"
+#include "ast.hpp"
+#include "binop.hpp"
+#include "memo.hpp"
+#include "registry.hpp"
+#include "KaleidoscopeJIT.h"
+
+using namespace llvm;
+using namespace AST;
+
+extern std::unique_ptr<orc::KaleidoscopeJIT> jit;
+extern std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
+extern BinopTable binops;
+
+// File layout: the magic, then records of a u32 tag, a u32 reserved word and a
+// u64 payload length, each payload padded to 16 bytes. Integers are little
+// endian and strings are a u32 length followed by the bytes. Objects are
+// stored 16-byte aligned so they can be linked in place from the mapping.
+namespace {
+    constexpr char magic[8] = {'K', 'S', 'N', 'A', 'P', '0', '0', '6'};
+    constexpr size_t recordAlign = 16;
+
+    enum RecordTag : uint32_t {
+        TargetTag = 1,
+        ProtoTag,
+        FunctionTag,
+        BinopTag,
+        MemoTag,
+        ModuleTag,
+        MemoTableTag,
+    };
+
+    class Payload {
+        std::string buf;
+
+    public:
+        void u8(uint8_t v) { buf.push_back(static_cast<char>(v)); }
+
+        void u32(uint32_t v) {
+            char b[4];
+            support::endian::write32le(b, v);
+            buf.append(b, 4);
+        }
+
+        void u64(uint64_t v) {
+            char b[8];
+            support::endian::write64le(b, v);
+            buf.append(b, 8);
+        }
+
+        void str(StringRef s) {
+            u32(s.size());
+            buf.append(s.begin(), s.end());
+        }
+
+        /// A u64 length, then the bytes starting at the next 16-byte boundary.
+        void blob(StringRef s) {
+            u64(s.size());
+            buf.resize(alignTo(buf.size(), recordAlign));
+            buf.append(s.begin(), s.end());
+        }
+
+        [[nodiscard]] const std::string &data() const { return buf; }
+    };
+
+    void writeRecord(raw_ostream &os, RecordTag tag, const Payload &payload) {
+        Payload header;
+        header.u32(tag);
+        header.u32(0);
+        header.u64(payload.data().size());
+        os << header.data() << payload.data();
+        os.write_zeros(offsetToAlignment(payload.data().size(), Align(recordAlign)));
+    }
+
+    /// Reads a payload in place; every read fails softly once the payload runs out.
+    class Reader {
+        StringRef data;
+        size_t pos = 0;
+        bool failed = false;
+
+        const char* take(size_t n) {
+            if (failed || data.size() - pos < n) {
+                failed = true;
+                return nullptr;
+            }
+            auto* p = data.data() + pos;
+            pos += n;
+            return p;
+        }
+
+    public:
+        explicit Reader(StringRef data) : data(data) {}
+
+        uint8_t u8() {
+            auto* p = take(1);
+            return p ? static_cast<uint8_t>(*p) : 0;
+        }
+
+        uint32_t u32() {
+            auto* p = take(4);
+            return p ? support::endian::read32le(p) : 0;
+        }
+
+        uint64_t u64() {
+            auto* p = take(8);
+            return p ? support::endian::read64le(p) : 0;
+        }
+
+        StringRef str() {
+            auto n = u32();
+            auto* p = take(n);
+            return p ? StringRef(p, n) : StringRef();
+        }
+
+        StringRef blob() {
+            auto n = u64();
+            take(alignTo(pos, recordAlign) - pos);
+            auto* p = take(n);
+            return p ? StringRef(p, n) : StringRef();
+        }
+
+        [[nodiscard]] bool ok() const { return !failed; }
+
+        [[nodiscard]] bool done() const { return pos == data.size(); }
+    };
+
+    /// Mappings of restored snapshots; jitted objects are linked straight from them.
+    std::vector<std::unique_ptr<MemoryBuffer>> mappedSnapshots;
+}
+
+bool writeSnapshot(const std::string &path) {
+    std::error_code ec;
+    raw_fd_ostream os(path, ec, sys::fs::OF_None);
+    if (ec) {
+        fprintf(stderr, "Error: Cannot write snapshot %s: %s\n", path.c_str(), ec.message().c_str());
+        return false;
+    }
+    os.write(magic, sizeof(magic));
+    os.write_zeros(recordAlign - sizeof(magic));
+
+    Payload target;
+    target.str(jit->getTargetCPU());
+    target.u32(numberBits());
+    writeRecord(os, TargetTag, target);
+
+    for (auto &[name, proto]: functionProtos) {
+        Payload p;
+        p.str(name);
+        p.u32(proto->getArgs().size());
+        for (auto &arg: proto->getArgs())
+            p.str(arg);
+        p.u8(proto->isUnaryOp() || proto->isBinaryOp());
+        p.u32(proto->getBinaryPrecedence());
+        p.u32(proto->getLine());
+        writeRecord(os, ProtoTag, p);
+    }
+    for (auto &[name, info]: functionInfos) {
+        Payload p;
+        p.str(name);
+        p.u32(info.version);
+        p.u8(info.external);
+        p.u8(info.hasLoop);
+        p.u32(info.callees.size());
+        for (auto &callee: info.callees)
+            p.str(callee);
+        p.u32(info.specialized.size());
+        for (auto &clone: info.specialized)
+            p.str(clone);
+        writeRecord(os, FunctionTag, p);
+    }
+    binops.forEach([&](char op, BinopTable::Entry entry) {
+        Payload p;
+        p.u8(op);
+        p.u32(entry.prec);
+        p.u8(entry.rightAssoc);
+        writeRecord(os, BinopTag, p);
+    });
+    // Memo tables must exist before the modules whose wrappers load them.
+    forEachMemoSize([&](const std::string &name, size_t entries) {
+        Payload p;
+        p.str(name);
+        p.u64(entries);
+        writeRecord(os, MemoTag, p);
+    });
+    forEachMemoTable([&](const std::string &name, uint64_t serial, unsigned arity, size_t entries) {
+        Payload p;
+        p.str(name);
+        p.u64(serial);
+        p.u32(arity);
+        p.u64(entries);
+        writeRecord(os, MemoTableTag, p);
+    });
+    size_t modules = 0;
+    jit->forEachRetainedModule([&](ArrayRef<std::string> defines, StringRef bitcode, MemoryBufferRef object) {
+        Payload p;
+        p.u32(defines.size());
+        for (auto &define: defines)
+            p.str(define);
+        p.blob(bitcode);
+        p.blob(object.getBuffer());
+        writeRecord(os, ModuleTag, p);
+        modules++;
+    });
+
+    os.close();
+    if (os.has_error()) {
+        fprintf(stderr, "Error: Cannot write snapshot %s: %s\n", path.c_str(), os.error().message().c_str());
+        os.clear_error();
+        return false;
+    }
+    fprintf(stderr, "Wrote %zu prototypes and %zu modules to %s\n", functionProtos.size(), modules, path.c_str());
+    return true;
+}
+
+bool restoreSnapshot(const std::string &path) {
+    auto file = MemoryBuffer::getFile(path, false, false);
+    if (!file) {
+        fprintf(stderr, "Error: Cannot read snapshot %s: %s\n", path.c_str(), file.getError().message().c_str());
+        return false;
+    }
+    StringRef data = (*file)->getBuffer();
+    if (data.size() < recordAlign || !data.startswith(StringRef(magic, sizeof(magic)))) {
+        fprintf(stderr, "Error: %s is not a snapshot\n", path.c_str());
+        return false;
+    }
+    // Restored objects may be linked from the mapping, so it lives as long as the session.
+    mappedSnapshots.push_back(std::move(*file));
+
+    bool sameTarget = false;
+    size_t modules = 0, recompiled = 0;
+    LLVMContext bitcodeCtx;
+    for (size_t pos = recordAlign; pos < data.size();) {
+        Reader header(data.substr(pos, recordAlign));
+        auto tag = header.u32();
+        header.u32();
+        auto len = header.u64();
+        if (!header.ok() || len > data.size() - pos - recordAlign) {
+            fprintf(stderr, "Error: Truncated snapshot %s\n", path.c_str());
+            return false;
+        }
+        Reader r(data.substr(pos + recordAlign, len));
+        pos += recordAlign + alignTo(len, recordAlign);
+
+        switch (tag) {
+            case TargetTag: {
+                sameTarget = r.str() == jit->getTargetCPU();
+                // Definitions pass numbers to each other at the precision they were compiled with.
+                auto bits = r.u32();
+                if (bits != numberBits()) {
+                    fprintf(stderr, "Error: %s was saved with %u-bit numbers, this session uses %u-bit numbers\n",
+                            path.c_str(), bits, numberBits());
+                    return false;
+                }
+                break;
+            }
+            case ProtoTag: {
+                auto name = r.str().str();
+                std::vector<std::string> args(r.u32());
+                for (auto &arg: args)
+                    arg = r.str().str();
+                bool isOp = r.u8();
+                unsigned prec = r.u32();
+                auto proto = std::make_unique<PrototypeAST>(name, std::move(args), isOp, prec);
+                proto->setLine(static_cast<int>(r.u32()));
+                functionProtos[name] = std::move(proto);
+                break;
+            }
+            case FunctionTag: {
+                auto &info = functionInfos[r.str().str()];
+                info.version = r.u32();
+                info.external = r.u8();
+                info.hasLoop = r.u8();
+                info.callees.clear();
+                for (auto n = r.u32(); n && r.ok(); n--)
+                    info.callees.insert(r.str().str());
+                info.specialized.clear();
+                for (auto n = r.u32(); n && r.ok(); n--)
+                    info.specialized.insert(r.str().str());
+                break;
+            }
+            case BinopTag: {
+                auto op = static_cast<char>(r.u8());
+                auto prec = static_cast<int>(r.u32());
+                binops.define(op, prec, r.u8());
+                break;
+            }
+            case MemoTag: {
+                auto name = r.str().str();
+                setMemoSize(name, r.u64());
+                break;
+            }
+            case MemoTableTag: {
+                auto name = r.str().str();
+                auto serial = r.u64();
+                auto arity = r.u32();
+                auto entries = r.u64();
+                if (r.ok())
+                    restoreMemoTable(name, serial, arity, entries);
+                break;
+            }
+            case ModuleTag: {
+                std::vector<std::string> defines(r.u32());
+                for (auto &define: defines)
+                    define = r.str().str();
+                auto bitcode = r.blob();
+                auto object = r.blob();
+                if (!r.ok())
+                    break;
+                modules++;
+                if (sameTarget) {
+                    jit->addObject(MemoryBuffer::getMemBuffer(object, path, false), std::move(defines), bitcode);
+                    break;
+                }
+                auto m = parseBitcodeFile(MemoryBufferRef(bitcode, path), bitcodeCtx);
+                if (!m) {
+                    fprintf(stderr, "Error: Bad module in snapshot %s: %s\n", path.c_str(),
+                            toString(m.takeError()).c_str());
+                    return false;
+                }
+                (*m)->setDataLayout(jit->getTargetMachine().createDataLayout());
+                (*m)->setTargetTriple(jit->getTargetMachine().getTargetTriple().str());
+                jit->addModule(std::move(*m), true);
+                recompiled++;
+                break;
+            }
+            default:
+                // Unknown records come from newer writers and are skipped.
+                continue;
+        }
+        if (!r.ok() || !r.done()) {
+            fprintf(stderr, "Error: Corrupt record in snapshot %s\n", path.c_str());
+            return false;
+        }
+    }
+
+    // The restored objects were compiled with exactly these effects.
+    updateEffects();
+    fprintf(stderr, "Restored %zu prototypes and %zu modules from %s", functionProtos.size(), modules, path.c_str());
+    if (recompiled)
+        fprintf(stderr, " (%zu recompiled for this target)", recompiled);
+    fprintf(stderr, "\n");
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+
+/// A snapshot holds everything a session has built up: prototypes, operator
+/// precedences, the function registry and, for every live definition, its
+/// optimized bitcode and relocatable object. Restoring one maps the file and
+/// hands the objects straight to the JIT, skipping lexing, parsing and the
+/// pass pipeline. If the host target differs from the one the snapshot was
+/// written on, the bitcode is compiled again instead.
+bool writeSnapshot(const std::string &path);
+
+bool restoreSnapshot(const std::string &path);
+
+#endif //SNAPSHOT_HPP
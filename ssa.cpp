@@ -0,0 +1,102 @@
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include "ssa.hpp"
+
+using namespace llvm;
+
+SSABuilder::Variable SSABuilder::newVariable(const std::string &name, Type* type) {
+    names.push_back(name);
+    types.push_back(type);
+    return names.size() - 1;
+}
+
+void SSABuilder::write(Variable var, BasicBlock* block, Value* val) {
+    currentDef[{var, block}] = val;
+}
+
+Value* SSABuilder::read(Variable var, BasicBlock* block) {
+    auto it = currentDef.find({var, block});
+    if (it != currentDef.end() && it->second)
+        return it->second;
+    return readRecursive(var, block);
+}
+
+Value* SSABuilder::readRecursive(Variable var, BasicBlock* block) {
+    Value* val;
+    if (!sealed.count(block)) {
+        // More predecessors may come; complete the phi when the block is sealed.
+        auto* phi = newPhi(var, block);
+        incompletePhis[block].emplace_back(var, phi);
+        val = phi;
+    } else if (auto* pred = block->getSinglePredecessor()) {
+        val = read(var, pred);
+    } else {
+        // Record the phi first so that reads through a loop find it.
+        auto* phi = newPhi(var, block);
+        write(var, block, phi);
+        val = addPhiOperands(var, phi);
+    }
+    write(var, block, val);
+    return val;
+}
+
+PHINode* SSABuilder::newPhi(Variable var, BasicBlock* block) {
+    IRBuilder<> b(block, block->begin());
+    return b.CreatePHI(types[var], 2, names[var]);
+}
+
+Value* SSABuilder::addPhiOperands(Variable var, PHINode* phi) {
+    filling.insert(phi);
+    for (auto* pred: predecessors(phi->getParent()))
+        phi->addIncoming(read(var, pred), pred);
+    filling.erase(phi);
+    return tryRemoveTrivialPhi(phi);
+}
+
+Value* SSABuilder::tryRemoveTrivialPhi(PHINode* phi) {
+    Value* same = nullptr;
+    for (Value* op: phi->incoming_values()) {
+        if (op == same || op == phi)
+            continue;
+        if (same)
+            return phi;
+        same = op;
+    }
+    if (!same)
+        same = UndefValue::get(phi->getType());
+
+    SmallVector<WeakVH, 4> phiUsers;
+    for (User* user: phi->users())
+        if (user != phi && isa<PHINode>(user))
+            phiUsers.emplace_back(user);
+    WeakTrackingVH result = same;
+    phi->replaceAllUsesWith(same);
+    phi->eraseFromParent();
+    // Removing this phi may have made the phis using it trivial.
+    for (auto &user: phiUsers)
+        if (auto* userPhi = cast_or_null<PHINode>(user); userPhi && !filling.count(userPhi))
+            tryRemoveTrivialPhi(userPhi);
+    return result;
+}
+
+void SSABuilder::seal(BasicBlock* block) {
+    if (!sealed.insert(block).second)
+        return;
+    auto it = incompletePhis.find(block);
+    if (it == incompletePhis.end())
+        return;
+    auto phis = std::move(it->second);
+    incompletePhis.erase(it);
+    for (auto &[var, phi]: phis)
+        addPhiOperands(var, phi);
+}
+
+void SSABuilder::clear() {
+    names.clear();
+    types.clear();
+    currentDef.clear();
+    sealed.clear();
+    incompletePhis.clear();
+    filling.clear();
+}
@@ -0,0 +1,58 @@
+#ifndef SSA_HPP
+#define SSA_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/ValueHandle.h>
+
+/// SSABuilder - builds SSA form for Kaleidoscope variables while their function
+/// is being lowered, following Braun et al., "Simple and Efficient Construction
+/// of Static Single Assignment Form". Every write records the variable's value
+/// in the current block; a read in a block without one looks through its
+/// predecessors, placing phis only where definitions actually merge. A block
+/// must be sealed once all its predecessors have been branched from, which
+/// completes the phis placed while it still had unknown predecessors.
+class SSABuilder {
+public:
+    using Variable = unsigned;
+
+    /// A fresh variable of the given type; each binding of a name, even a
+    /// shadowing one, is its own.
+    Variable newVariable(const std::string &name, llvm::Type* type);
+
+    [[nodiscard]] llvm::Type* getType(Variable var) const { return types[var]; }
+
+    void write(Variable var, llvm::BasicBlock* block, llvm::Value* val);
+
+    llvm::Value* read(Variable var, llvm::BasicBlock* block);
+
+    void seal(llvm::BasicBlock* block);
+
+    /// Forget all state; blocks of earlier functions may be freed and reused.
+    void clear();
+
+private:
+    llvm::Value* readRecursive(Variable var, llvm::BasicBlock* block);
+
+    llvm::PHINode* newPhi(Variable var, llvm::BasicBlock* block);
+
+    llvm::Value* addPhiOperands(Variable var, llvm::PHINode* phi);
+
+    llvm::Value* tryRemoveTrivialPhi(llvm::PHINode* phi);
+
+    std::vector<std::string> names;
+    std::vector<llvm::Type*> types;
+    /// Tracking handles follow trivial phis to the value that replaced them.
+    llvm::DenseMap<std::pair<Variable, llvm::BasicBlock*>, llvm::WeakTrackingVH> currentDef;
+    llvm::SmallPtrSet<llvm::BasicBlock*, 16> sealed;
+    llvm::DenseMap<llvm::BasicBlock*, std::vector<std::pair<Variable, llvm::PHINode*>>> incompletePhis;
+    /// Phis whose operands are being added; they cannot be judged trivial yet.
+    llvm::SmallPtrSet<llvm::PHINode*, 8> filling;
+};
+
+#endif //SSA_HPP
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include "stream.hpp"
+
+namespace {
+    constexpr size_t bufferSize = 1 << 20;
+    /// Records per kernel call: enough to amortize the call, small enough to stay in cache.
+    constexpr size_t batchRows = 4096;
+
+    /// Block-buffered reads from a file descriptor.
+    class Reader {
+    public:
+        explicit Reader(int fd) : fd(fd), buf(bufferSize) {}
+
+        /// Unconsumed bytes, [begin(), end()).
+        [[nodiscard]] const char* begin() const { return buf.data() + pos; }
+
+        [[nodiscard]] const char* end() const { return buf.data() + len; }
+
+        void consume(const char* upTo) { pos = upTo - buf.data(); }
+
+        /// Read more after the unconsumed bytes, growing the buffer if they fill
+        /// it. Returns false at end of file or on error, see failed().
+        bool fill() {
+            std::memmove(buf.data(), begin(), len - pos);
+            len -= pos;
+            pos = 0;
+            if (len == buf.size())
+                buf.resize(buf.size() * 2);
+            while (true) {
+                ssize_t n = read(fd, buf.data() + len, buf.size() - len);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0) {
+                    fprintf(stderr, "Error: Cannot read records: %s\n", strerror(errno));
+                    error = true;
+                }
+                if (n <= 0)
+                    return false;
+                len += n;
+                return true;
+            }
+        }
+
+        [[nodiscard]] bool failed() const { return error; }
+
+    private:
+        int fd;
+        std::vector<char> buf;
+        size_t pos = 0, len = 0;
+        bool error = false;
+    };
+
+    /// Block-buffered writes to a file descriptor.
+    class Writer {
+    public:
+        explicit Writer(int fd) : fd(fd), buf(bufferSize) {}
+
+        /// Room for at least n more bytes, flushing if needed.
+        char* reserve(size_t n) {
+            if (buf.size() - len < n && !flush())
+                return nullptr;
+            return buf.data() + len;
+        }
+
+        void commit(const char* upTo) { len = upTo - buf.data(); }
+
+        bool flush() {
+            for (size_t done = 0; done < len;) {
+                ssize_t n = write(fd, buf.data() + done, len - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0) {
+                    fprintf(stderr, "Error: Cannot write results: %s\n", strerror(errno));
+                    return false;
+                }
+                done += n;
+            }
+            len = 0;
+            return true;
+        }
+
+    private:
+        int fd;
+        std::vector<char> buf;
+        size_t len = 0;
+    };
+
+    /// Run the rows gathered in `in` and write their results.
+    bool runBatch(BatchKernel kernel, const std::vector<double> &in, std::vector<double> &out, size_t rows,
+                  StreamFormat format, Writer &writer) {
+        kernel(in.data(), out.data(), rows);
+        if (format == StreamFormat::Binary) {
+            char* p = writer.reserve(rows * sizeof(double));
+            if (!p)
+                return false;
+            std::memcpy(p, out.data(), rows * sizeof(double));
+            writer.commit(p + rows * sizeof(double));
+            return true;
+        }
+        // The shortest representation that reads back as the same double.
+        constexpr size_t maxChars = 32;
+        char* p = writer.reserve(rows * maxChars);
+        if (!p)
+            return false;
+        for (size_t i = 0; i < rows; i++) {
+            p = std::to_chars(p, p + maxChars, out[i]).ptr;
+            *p++ = '\n';
+        }
+        writer.commit(p);
+        return true;
+    }
+
+    bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    /// Parse one line of arity comma-separated numbers into fields.
+    bool parseLine(const char* p, const char* end, unsigned arity, double* fields, size_t lineNo) {
+        for (unsigned i = 0; i < arity; i++) {
+            while (p != end && isBlank(*p))
+                p++;
+            if (i > 0) {
+                if (p == end || *p != ',') {
+                    fprintf(stderr, "Error: Line %zu: expected %u fields\n", lineNo, arity);
+                    return false;
+                }
+                p++;
+                while (p != end && isBlank(*p))
+                    p++;
+            }
+            auto [next, ec] = std::from_chars(p, end, fields[i]);
+            if (ec != std::errc()) {
+                fprintf(stderr, "Error: Line %zu: expected a number in field %u\n", lineNo, i + 1);
+                return false;
+            }
+            p = next;
+        }
+        while (p != end && isBlank(*p))
+            p++;
+        if (p != end) {
+            fprintf(stderr, "Error: Line %zu: expected %u fields\n", lineNo, arity);
+            return false;
+        }
+        return true;
+    }
+}
+
+bool streamRecords(BatchKernel kernel, unsigned arity, StreamFormat format, int inFd, int outFd) {
+    Reader reader(inFd);
+    Writer writer(outFd);
+    std::vector<double> in(batchRows * std::max(arity, 1u)), out(batchRows);
+    size_t rows = 0;
+
+    if (format == StreamFormat::Binary) {
+        size_t recordSize = arity * sizeof(double);
+        if (!recordSize) {
+            fprintf(stderr, "Error: Binary records need a function with parameters\n");
+            return false;
+        }
+        while (reader.fill()) {
+            while (reader.end() - reader.begin() >= static_cast<std::ptrdiff_t>(recordSize)) {
+                size_t n = std::min<size_t>((reader.end() - reader.begin()) / recordSize, batchRows);
+                std::memcpy(in.data(), reader.begin(), n * recordSize);
+                reader.consume(reader.begin() + n * recordSize);
+                if (!runBatch(kernel, in, out, n, format, writer))
+                    return false;
+            }
+        }
+        if (reader.begin() != reader.end()) {
+            fprintf(stderr, "Error: Input ends in a partial record\n");
+            writer.flush();
+            return false;
+        }
+        return !reader.failed() && writer.flush();
+    }
+
+    size_t lineNo = 0;
+    bool eof = false;
+    while (!eof) {
+        eof = !reader.fill();
+        if (reader.failed())
+            return false;
+        const char* p = reader.begin();
+        while (true) {
+            auto* nl = static_cast<const char*>(std::memchr(p, '\n', reader.end() - p));
+            // At end of file the last line needs no newline.
+            if (!nl && !(eof && p != reader.end()))
+                break;
+            const char* lineEnd = nl ? nl : reader.end();
+            lineNo++;
+            const char* q = p;
+            while (q != lineEnd && isBlank(*q))
+                q++;
+            if (q != lineEnd) {
+                if (!parseLine(p, lineEnd, arity, &in[rows * arity], lineNo)) {
+                    if (runBatch(kernel, in, out, rows, format, writer))
+                        writer.flush();
+                    return false;
+                }
+                if (++rows == batchRows) {
+                    if (!runBatch(kernel, in, out, rows, format, writer))
+                        return false;
+                    rows = 0;
+                }
+            }
+            p = nl ? nl + 1 : lineEnd;
+        }
+        reader.consume(p);
+    }
+    return (!rows || runBatch(kernel, in, out, rows, format, writer)) && writer.flush();
+}
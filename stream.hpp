@@ -0,0 +1,22 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include <cstdint>
+
+/// A compiled kernel applying a function to `rows` records of its arguments
+/// laid out one after another in `in`, storing one result per record to `out`.
+using BatchKernel = void (*)(const double* in, double* out, uint64_t rows);
+
+enum class StreamFormat {
+    /// One record per line, its fields separated by commas; one result per line.
+    Text,
+    /// Records of native doubles back to back; one double per result.
+    Binary,
+};
+
+/// Run every record read from inFd until end of file through kernel in
+/// batches, writing the results to outFd. Returns false after reporting
+/// malformed input or an I/O error; results of earlier records are written.
+bool streamRecords(BatchKernel kernel, unsigned arity, StreamFormat format, int inFd, int outFd);
+
+#endif //STREAM_HPP